@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L // getline and strdup
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,42 +7,121 @@
 #include <errno.h>
 #include "apexOpcodes.h" // Use the same set of opcodes as the simulator!
 #include "apexOpInfo.h" // Include definition of APEX opcodes
-
-extern char* strdup(const char*); // Prototype not in string.h when c standard>c99
+#include "apexObj.h" // Binary object format
 
 /*---------------------------------------------------------
   Function declarations for internal functions
 ---------------------------------------------------------*/
-int tokenize(int lnum,char *line,char * tokens[],int tokenPos[]);
+int tokenize(int lnum,char *line,char * tokens[],int tokenPos[],int *hasLabel);
+char * arenaCopy(const char *string);
+void directive(char *line,int lnum,int ntokens,char *token[],int tokenPos[],int textObj,int quiet);
+void defineSymbol(char *line,int lnum,int col,char *name,int value,int kind);
+int findSymbol(const char *name);
+int validSymbol(const char *name);
+unsigned int hashName(const char *name);
+void hashSymbol(int s);
+int addString(const char *string);
+void addData(int value);
 void printEmsg(char *line,int lnum,int col,char *txt);
 void strUpper(char * string);
+void sortMnemonics();
+int findOpcode(const char *mnemonic);
+int compareMnemonic(const void *a,const void *b);
 int getRegister(char *string);
-int getImmediate(char *string);
+int getNumber(char *string);
+int getValue(char *string);
+int getOffset(char *string,int pc);
 int makeInstruction(unsigned char opNum,enum opFormat_enum  format,int dr,int sr1,int sr2,int imm,int offset);
+void addInstruction(int inst,int inum,int lineNum,char *asmLine);
+int writeBinary(FILE *objF);
+void freeObject();
 
 /*---------------------------------------------------------
   Global Variables
 ---------------------------------------------------------*/
-#define LINELENGTH 128
-#define MAXTOKENS 10
+#define MAXTOKENS 64 // a .word line can have up to 62 values
+#define OUTBUFSIZE (1<<20) // stdout and the object file are written in blocks this big
+
+// Token storage... tokenize copies each line here, and the copy is reused for the next line
+char *arena=NULL;
+size_t arenaSize=0;
+
+// Opcode numbers sorted by mnemonic, for findOpcode
+int sortedOps[NUMOPS];
+
+int asmPass; // 1 defines the symbols, 2 assembles... errors are only printed in pass 2
+int inData; // set between .data and .text
+int errorCount=0;
+
+// Symbol table - labels and .equ names, in definition order, with an open
+//    addressing hash table of indexes into it (-1 for an empty slot)
+enum symKind_enum {
+	sym_text, // label in .text, an instruction address
+	sym_data, // label in .data, a data address
+	sym_equ // .equ name, a plain number
+};
+struct symbol_struct {
+	int name; // offset in objStrings
+	int value; // address of a label, or the .equ value
+	int lineNum; // where it is defined
+	int kind; // enum symKind_enum
+};
+struct symbol_struct *symbols=NULL;
+int symCount=0;
+int symSize=0;
+int *symHash=NULL;
+int symHashSize=0; // a power of 2, at least twice symCount
+
+// Binary object contents, written when assembly is complete
+uint32_t *objCode=NULL;
+struct apexObjLine_struct *objLines=NULL;
+int objCount=0;
+int objSize=0;
+char *objStrings=NULL;
+int objStrBytes=0;
+int objStrSize=0;
+int32_t *objData=NULL; // data section, loaded at address 0
+int objDataCount=0;
+int objDataSize=0;
 
 /*---------------------------------------------------------
   Main function
-  		command line args: assembly file name
+  		command line args: [-t] [-q] assembly file name
 
   		Reads the assembly file name and creates an
   		object file (replacing .s with .o) that contains
-  		the APEX "binary" instructions read from the
-  		assembly file.
+  		the APEX binary instructions read from the
+  		assembly file, in the format defined in apexObj.h.
+  		With -t, writes the older text object format instead.
+  		With -q, only prints errors, not each instruction.
+
+  		The file is read twice. Pass 1 only defines labels
+  		(name: at the start of a line) and .equ names, so
+  		pass 2 can use them before they are defined. A
+  		label in .text is the address of the next instruction,
+  		and a branch to it gets the offset from the branch.
+  		A branch to an .equ name takes its value as the offset.
+  		.data starts the data section, loaded at address 0,
+  		where .word and .space lay out initialized words and
+  		labels are data addresses. .text goes back to code.
 ---------------------------------------------------------*/
 int main(int argc,char **argv) {
 	char * asmFile;
-	if (argc<2) {
-		printf("Invoke as %s <asmFile.s>\n",argv[0]);
+	int textObj=0;
+	int quiet=0;
+	int posArg=1;
+	while (argc>posArg && argv[posArg][0]=='-') {
+		if (0==strcmp(argv[posArg],"-t")) textObj=1;
+		else if (0==strcmp(argv[posArg],"-q")) quiet=1;
+		else break;
+		posArg++;
+	}
+	if (argc<=posArg) {
+		printf("Invoke as %s [-t] [-q] <asmFile.s>\n",argv[0]);
 		return 1;
 	}
 
-	asmFile=argv[1];
+	asmFile=argv[posArg];
 	char * objFile=strdup(asmFile);
 	int dp=strlen(objFile)-2;
 	if (strcmp(objFile+dp,".s")!=0) {
@@ -56,7 +136,7 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
-	FILE * objF=fopen(objFile,"w");
+	FILE * objF=fopen(objFile,textObj?"w":"wb");
 	if (objF==NULL) {
 		perror("Error - unable to open object output file for write\n");
 		fclose(asmF);
@@ -64,194 +144,242 @@ int main(int argc,char **argv) {
 		return 1;
 	}
 
+	setvbuf(stdout,NULL,_IOFBF,OUTBUFSIZE);
+	setvbuf(objF,NULL,_IOFBF,OUTBUFSIZE);
 	printf("Info - Assembling from %s into %s\n",asmFile,objFile);
 
-	char asmLine[LINELENGTH];
+	char *asmLine=NULL; // Grown by getline to fit the longest line
+	size_t asmLineSize=0;
 	char * token[MAXTOKENS];
 	int tokenPos[MAXTOKENS];
+	sortMnemonics();
 
 	int lineNum=0;
 	int inum=0; // Instruction number
-	while(!feof(asmF)) {
-		if (NULL==fgets(asmLine,LINELENGTH,asmF)) {
-			if (feof(asmF)) continue;
-			perror("Error - reading from asmFile:");
-			fclose(asmF);
-			fclose(objF);
-			free(objFile);
-			return 1;
-		}
-		lineNum++;
-		// Strip trailing newline if there
-		int ll=strlen(asmLine);
-		if (asmLine[ll-1]=='\n') asmLine[ll-1]='\0';
-		int ntokens=tokenize(lineNum,asmLine,token,tokenPos);
-		if (ntokens==0) continue; // Empty line
-		// Convert first token to uppercase
-		strUpper(token[0]);
-		// Find opcode that matches token[0] mnemonic
-		int opcode=-1;
-		for(int i=0;i<NUMOPS;i++) {
-			if (0==strcmp(token[0],opInfo[i].mnemonic)) {
-				opcode=i;
-				break;
-			}
-		}
-		if (opcode==-1) {
-			printEmsg(asmLine,lineNum,tokenPos[0],"Invalid opcode mnemonic");
-			continue;
-		}
-		int dr,sr1,sr2,imm,offset;
-		// Remaining token requirements deped on opcode format
-		enum opFormat_enum format =opInfo[opcode].format;
-		switch(format) {
-			case fmt_nop:
-				if (ntokens>1) {
-					printEmsg(asmLine,lineNum,tokenPos[1],"Extra token(s) ignored");
+	ssize_t ll;
+	for(asmPass=1;asmPass<=2;asmPass++) {
+		lineNum=inum=0;
+		inData=0;
+		objDataCount=0;
+		rewind(asmF);
+		while(-1!=(ll=getline(&asmLine,&asmLineSize,asmF))) {
+			lineNum++;
+			// Strip trailing newline (and carriage return) if there
+			while(ll>0 && (asmLine[ll-1]=='\n' || asmLine[ll-1]=='\r')) asmLine[--ll]='\0';
+			int hasLabel=0;
+			int ntokens=tokenize(lineNum,asmLine,token,tokenPos,&hasLabel);
+			if (hasLabel) {
+				if (inData) defineSymbol(asmLine,lineNum,tokenPos[0],token[0],4*objDataCount,sym_data);
+				else defineSymbol(asmLine,lineNum,tokenPos[0],token[0],0x4000+4*inum,sym_text);
+				for(int t=1;t<ntokens;t++) {
+					token[t-1]=token[t];
+					tokenPos[t-1]=tokenPos[t];
 				}
-				break;
-			case fmt_dss:
-				dr=sr1=sr2=-1;
-				if (ntokens>1) {
-					dr=getRegister(token[1]);
-					if (dr<0 || dr>15) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
-						dr=-1;
+				ntokens--;
+			}
+			if (ntokens==0) continue; // Empty line, or only a label
+			if (token[0][0]=='.') {
+				directive(asmLine,lineNum,ntokens,token,tokenPos,textObj,quiet);
+				continue;
+			}
+			// Convert first token to uppercase
+			strUpper(token[0]);
+			// Find opcode that matches token[0] mnemonic
+			int opcode=findOpcode(token[0]);
+			if (opcode==-1) {
+				printEmsg(asmLine,lineNum,tokenPos[0],"Invalid opcode mnemonic");
+				continue;
+			}
+			if (inData) {
+				printEmsg(asmLine,lineNum,tokenPos[0],"Instruction in the .data section");
+				continue;
+			}
+			if (asmPass==1) {
+				inum++; // Only the instruction count matters in pass 1
+				continue;
+			}
+			int pc=0x4000+4*inum;
+			int dr,sr1,sr2,imm,offset;
+			// Remaining token requirements deped on opcode format
+			enum opFormat_enum format =opInfo[opcode].format;
+			switch(format) {
+				case fmt_nop:
+					if (ntokens>1) {
+						printEmsg(asmLine,lineNum,tokenPos[1],"Extra token(s) ignored");
 					}
-					if (ntokens>2) {
-						sr1=getRegister(token[2]);
-						if (sr1<0 || sr1>15) {
-							printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
-							sr1=-1;
+					break;
+				case fmt_dss:
+					dr=sr1=sr2=-1;
+					if (ntokens>1) {
+						dr=getRegister(token[1]);
+						if (dr<0 || dr>15) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
+							dr=-1;
 						}
-						if (ntokens>3) {
-							sr2=getRegister(token[3]);
-							if (sr2<0 || sr2>15) {
-								printEmsg(asmLine,lineNum,tokenPos[3],"Invalid second source register");
-								sr2=-1;
+						if (ntokens>2) {
+							sr1=getRegister(token[2]);
+							if (sr1<0 || sr1>15) {
+								printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
+								sr1=-1;
 							}
-							if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
-						} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing second source register");
-					} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
-				break;
-
-			case fmt_dsi:
-				dr=sr1=-1; imm=INT_MIN;
-				if (ntokens>1) {
-					dr=getRegister(token[1]);
-					if (dr<0 || dr>15) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
-						dr=-1;
-					}
-					if (ntokens>2) {
-						sr1=getRegister(token[2]);
-						if (sr1<0 || sr1>15) {
-							printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
-							sr1=-1;
+							if (ntokens>3) {
+								sr2=getRegister(token[3]);
+								if (sr2<0 || sr2>15) {
+									printEmsg(asmLine,lineNum,tokenPos[3],"Invalid second source register");
+									sr2=-1;
+								}
+								if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
+							} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing second source register");
+						} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
+					break;
+
+				case fmt_dsi:
+					dr=sr1=-1; imm=INT_MIN;
+					if (ntokens>1) {
+						dr=getRegister(token[1]);
+						if (dr<0 || dr>15) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
+							dr=-1;
+						}
+						if (ntokens>2) {
+							sr1=getRegister(token[2]);
+							if (sr1<0 || sr1>15) {
+								printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
+								sr1=-1;
+							}
+							if (ntokens>3) {
+								imm=getValue(token[3]);
+								if (imm==INT_MIN) {
+									printEmsg(asmLine,lineNum,tokenPos[3],"Invalid immediate value or undefined label");
+									sr2=-1;
+								} else if (imm<-32768 || imm>32767) {
+									printEmsg(asmLine,lineNum,tokenPos[3],"Immediate value does not fit in 16 bits");
+								}
+								if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
+							} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing immediate value");
+						} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
+					break;
+
+				case fmt_di:
+					dr=-1; imm=INT_MIN;
+					if (ntokens>1) {
+						dr=getRegister(token[1]);
+						if (dr<0 || dr>15) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
+							dr=-1;
 						}
-						if (ntokens>3) {
-							imm=getImmediate(token[3]);
+						if (ntokens>2) {
+							imm=getValue(token[2]);
 							if (imm==INT_MIN) {
-								printEmsg(asmLine,lineNum,tokenPos[3],"Invalid immediate value");
-								sr2=-1;
+								printEmsg(asmLine,lineNum,tokenPos[2],"Invalid immediate value or undefined label");
+							} else if (imm<-32768 || imm>32767) {
+								printEmsg(asmLine,lineNum,tokenPos[2],"Immediate value does not fit in 16 bits");
 							}
-							if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
-						} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing immediate value");
-					} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
-				break;
-
-			case fmt_di:
-				dr=-1; imm=INT_MIN;
-				if (ntokens>1) {
-					dr=getRegister(token[1]);
-					if (dr<0 || dr>15) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid destination register");
-						dr=-1;
-					}
-					if (ntokens>2) {
-						imm=getImmediate(token[2]);
-						if (imm==INT_MIN) {
-							printEmsg(asmLine,lineNum,tokenPos[2],"Invalid immediate value");
+							if (ntokens>3) printEmsg(asmLine,lineNum,tokenPos[2],"Extra tokens ignored");
+						} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing immediate value");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
+					break;
+
+				case fmt_ssi:
+					sr2=sr1=-1; imm=INT_MIN;
+					if (ntokens>1) {
+						sr2=getRegister(token[1]);
+						if (sr2<0 || sr2>15) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid second source register");
+							sr2=-1;
 						}
-						if (ntokens>3) printEmsg(asmLine,lineNum,tokenPos[2],"Extra tokens ignored");
-					} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing immediate value");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
-				break;
-
-			case fmt_ssi:
-				sr2=sr1=-1; imm=INT_MIN;
-				if (ntokens>1) {
-					sr2=getRegister(token[1]);
-					if (sr2<0 || sr2>15) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid second source register");
-						sr2=-1;
-					}
-					if (ntokens>2) {
-						sr1=getRegister(token[2]);
+						if (ntokens>2) {
+							sr1=getRegister(token[2]);
+							if (sr1<0 || sr1>15) {
+								printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
+								sr1=-1;
+							}
+							if (ntokens>3) {
+								imm=getValue(token[3]);
+								if (imm==INT_MIN) {
+									printEmsg(asmLine,lineNum,tokenPos[3],"Invalid immediate value or undefined label");
+									sr2=-1;
+								} else if (imm<-32768 || imm>32767) {
+									printEmsg(asmLine,lineNum,tokenPos[3],"Immediate value does not fit in 16 bits");
+								}
+								if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[4],"Extra tokens ignored");
+							} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing immediate value");
+						} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
+					break;
+
+				case fmt_ss:
+					sr1=sr2=-1;
+					if (ntokens>1) {
+						sr1=getRegister(token[1]);
 						if (sr1<0 || sr1>15) {
-							printEmsg(asmLine,lineNum,tokenPos[2],"Invalid first source register");
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid first source register");
 							sr1=-1;
 						}
-						if (ntokens>3) {
-							imm=getImmediate(token[3]);
-							if (imm==INT_MIN) {
-								printEmsg(asmLine,lineNum,tokenPos[3],"Invalid immediate value");
+						if (ntokens>2) {
+							sr2=getRegister(token[2]);
+							if (sr2<0 || sr2>15) {
+								printEmsg(asmLine,lineNum,tokenPos[2],"Invalid second source register");
 								sr2=-1;
 							}
-							if (ntokens>4) printEmsg(asmLine,lineNum,tokenPos[4],"Extra tokens ignored");
-						} else printEmsg(asmLine,lineNum,tokenPos[2],"Missing immediate value");
-					} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing first source register");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing destination register");
-				break;
-
-			case fmt_ss:
-				sr1=sr2=-1;
-				if (ntokens>1) {
-					sr1=getRegister(token[1]);
-					if (sr1<0 || sr1>15) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid first source register");
-						sr1=-1;
-					}
-					if (ntokens>2) {
-						sr2=getRegister(token[2]);
-						if (sr2<0 || sr2>15) {
-							printEmsg(asmLine,lineNum,tokenPos[2],"Invalid second source register");
-							sr2=-1;
+							if (ntokens>3) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
+						} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing second source register");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing first source register");
+					break;
+
+				case fmt_off:
+					offset=INT_MIN;
+					if (ntokens>1) {
+						int s=findSymbol(token[1][0]=='#'?token[1]+1:token[1]);
+						if (s>=0 && symbols[s].kind==sym_data) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"A data label is not a branch target");
+						} else if ((offset=getOffset(token[1],pc))==INT_MIN) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Invalid offset or undefined label");
+						} else if (offset<-(1<<23) || offset>=(1<<23)) {
+							printEmsg(asmLine,lineNum,tokenPos[1],"Offset does not fit in 24 bits");
 						}
-						if (ntokens>3) printEmsg(asmLine,lineNum,tokenPos[3],"Extra tokens ignored");
-					} else printEmsg(asmLine,lineNum,tokenPos[1],"Missing second source register");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing first source register");
-				break;
-
-			case fmt_off:
-				offset=INT_MIN;
-				if (ntokens>1) {
-					offset=getImmediate(token[1]);
-					if (offset==INT_MIN) {
-						printEmsg(asmLine,lineNum,tokenPos[1],"Invalid offset");
-					}
-					if (ntokens>2) printEmsg(asmLine,lineNum,tokenPos[2],"Extra tokens ignored");
-				} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing offset");
-				break;
-		}
-		free(token[0]);
-
-		if (opcode!=-1) {
-			int inst=makeInstruction(opcode,format,dr,sr1,sr2,imm,offset);
-			fprintf(objF,"%08x ; %3d : %s\n",inst,inum,asmLine);
-			printf(" %3d=I%d | %08x | %s\n",lineNum,inum,inst,asmLine);
-			inum++;
-		} else {
-			// printf(" %3d |          | %s\n",lineNum,asmLine);
-		}
-	} // End of loop through assembly file
+						if (ntokens>2) printEmsg(asmLine,lineNum,tokenPos[2],"Extra tokens ignored");
+					} else printEmsg(asmLine,lineNum,tokenPos[0],"Missing offset");
+					break;
+			}
 
+			if (opcode!=-1) {
+				int inst=makeInstruction(opcode,format,dr,sr1,sr2,imm,offset);
+				if (textObj) fprintf(objF,"%08x ; %3d : %s\n",inst,inum,asmLine);
+				else addInstruction(inst,inum,lineNum,asmLine);
+				if (!quiet) printf(" %3d=I%d | %08x | %s\n",lineNum,inum,inst,asmLine);
+				inum++;
+			} else {
+				// printf(" %3d |          | %s\n",lineNum,asmLine);
+			}
+		} // End of loop through assembly file
+		if (ferror(asmF)) break;
+	} // End of passes
+
+	int rc=0;
+	if (errorCount>0) {
+		printf("Error - %d error%s in %s\n",errorCount,errorCount==1?"":"s",asmFile);
+		rc=1;
+	}
+	if (ferror(asmF)) {
+		perror("Error - reading from asmFile");
+		rc=1;
+	} else if (!textObj && 0!=writeBinary(objF)) {
+		perror("Error - writing object file");
+		rc=1;
+	}
 	fclose(asmF);
-	fclose(objF);
+	if (0!=fclose(objF) && rc==0) {
+		perror("Error - writing object file");
+		rc=1;
+	}
+	free(asmLine);
+	free(arena);
 	free(objFile);
-	return 0;
+	freeObject();
+	return rc;
 }
 
 /*---------------------------------------------------------
@@ -261,22 +389,34 @@ int main(int argc,char **argv) {
   		The line is updated to put end-of-string (0x00) after each token
   		"tokenPos" keeps track of the location of each token in the input line
   		returns the number of tokens found.
+  		The tokens point into a copy of the line in the arena,
+  		which is only valid until the next line is tokenized.
+  		If the first token ends with ':' it is a label, and
+  		hasLabel is set.
 ---------------------------------------------------------*/
-int tokenize(int lnum,char *line,char * tokens[],int tokenPos[]) {
+int tokenize(int lnum,char *line,char * tokens[],int tokenPos[],int *hasLabel) {
 	int ntokes=0; // Note... comment does not count as a token
 	char * origLine=line;
 	int lp=0;
 	while ((line[lp])!=0x00) {
 		while(isspace((int)line[lp])) lp++;
 		if (line[lp]==';') return ntokes;
-		if (ntokes==0) line=strdup(origLine); // Make a copy in memory of the original
+		if (ntokes==0) line=arenaCopy(origLine); // Make a copy in memory of the original
+		if (ntokes==MAXTOKENS) {
+			printEmsg(origLine,lnum,lp,"Too many tokens, the rest of the line is ignored");
+			return ntokes;
+		}
 		tokenPos[ntokes]=lp;
 		tokens[ntokes++]=line+lp;
-		while(isalnum((int)line[lp]) || line[lp]=='#' || line[lp]=='-') lp++;
+		while(isalnum((int)line[lp]) || line[lp]=='#' || line[lp]=='-' || line[lp]=='_' || line[lp]=='.') lp++;
 		char rep=line[lp];
 		if (rep==0x00) return ntokes;
 		line[lp]=0x00; // Mark end of token
 		lp++;
+		if (rep==':' && ntokes==1) {
+			*hasLabel=1;
+			continue;
+		}
 		int ws=0;
 		if (isspace(rep)) {
 			while(isspace((int)line[lp])) lp++;
@@ -290,15 +430,30 @@ int tokenize(int lnum,char *line,char * tokens[],int tokenPos[]) {
 	return ntokes;
 }
 
+/*---------------------------------------------------------
+  arenaCopy copies a string into the arena, replacing
+  		what was there, and returns the copy
+---------------------------------------------------------*/
+char * arenaCopy(const char *string) {
+	size_t len=strlen(string)+1;
+	if (len>arenaSize) {
+		arenaSize=len>256?len:256;
+		free(arena);
+		arena=malloc(arenaSize);
+	}
+	memcpy(arena,string,len);
+	return arena;
+}
+
 /*---------------------------------------------------------
   printEmsg writes an error message, per the parameters
 ---------------------------------------------------------*/
 void printEmsg(char *line,int lnum,int col,char *txt) {
+	if (asmPass==1) return; // Pass 2 finds the same errors
+	errorCount++;
 	printf("Error - %s on line %d.%d\n",txt,lnum,col+1);
 	printf("  %3d | %s\n",lnum,line);
-	printf("      |");
-	for(int i=0;i<=col;i++) printf(" ");
-	printf("^\n");
+	printf("      |%*s^\n",col+1,"");
 }
 
 /*---------------------------------------------------------
@@ -311,24 +466,304 @@ void strUpper(char * string) {
 	}
 }
 
+/*---------------------------------------------------------
+  sortMnemonics sorts the opcode numbers by mnemonic so
+  		findOpcode can use a binary search
+---------------------------------------------------------*/
+void sortMnemonics() {
+	for(int i=0;i<NUMOPS;i++) sortedOps[i]=i;
+	qsort(sortedOps,NUMOPS,sizeof(int),compareMnemonic);
+}
+
+int compareMnemonic(const void *a,const void *b) {
+	return strcmp(opInfo[*(const int *)a].mnemonic,opInfo[*(const int *)b].mnemonic);
+}
+
+/*---------------------------------------------------------
+  findOpcode returns the opcode with the (upper case)
+  		mnemonic, or -1 if there is none
+---------------------------------------------------------*/
+int findOpcode(const char *mnemonic) {
+	int lo=0,hi=NUMOPS-1;
+	while(lo<=hi) {
+		int mid=(lo+hi)/2;
+		int cmp=strcmp(mnemonic,opInfo[sortedOps[mid]].mnemonic);
+		if (cmp==0) return sortedOps[mid];
+		if (cmp<0) hi=mid-1;
+		else lo=mid+1;
+	}
+	return -1;
+}
+
 /*---------------------------------------------------------
   getRegister converts a token Rxx into the int xx value
   		If token is not of the form Rxx, returns -1
 ---------------------------------------------------------*/
 int getRegister(char * string) {
-	int reg=-1;
-	sscanf(string,"R%d",&reg);
+	// strtol rather than sscanf, which is most of the time of a large assembly
+	if (string[0]!='R') return -1;
+	char *end;
+	long reg=strtol(string+1,&end,10);
+	if (end==string+1 || reg<INT_MIN || reg>INT_MAX) return -1;
 	return reg;
 }
 
 /*---------------------------------------------------------
-  getImmediate converts a token from #xx to the int xx value
-  		If token is not of the form #xx, returns -1
+  getNumber converts a token #xx (or xx) to the int xx value
+  		If token is not a number, returns INT_MIN
+  ---------------------------------------------------------*/
+int getNumber(char *string) {
+	if (string[0]=='#') string++;
+	char *end;
+	long value=strtol(string,&end,10);
+	if (end==string || *end!=0x00 || value<INT_MIN || value>INT_MAX) return INT_MIN;
+	return value;
+}
+
+/*---------------------------------------------------------
+  getValue converts a token that is a number, or the name
+  		of a label or .equ (with or without #), to its value.
+  		Returns INT_MIN if the token is neither, or the name
+  		is not defined.
+  ---------------------------------------------------------*/
+int getValue(char *string) {
+	char *name=string[0]=='#'?string+1:string;
+	if (name[0]=='-' || isdigit((int)name[0])) return getNumber(string);
+	int s=findSymbol(name);
+	if (s<0) return INT_MIN;
+	return symbols[s].value;
+}
+
+/*---------------------------------------------------------
+  getOffset converts the target of the branch at pc to an
+  		offset. A .text label is relative to pc, while a
+  		number or an .equ name is the offset itself.
+  		Returns INT_MIN like getValue
   ---------------------------------------------------------*/
-int getImmediate(char *string) {
-	int imm=INT_MIN;
-	sscanf(string,"#%d",&imm);
-	return imm;
+int getOffset(char *string,int pc) {
+	int value=getValue(string);
+	int s=findSymbol(string[0]=='#'?string+1:string);
+	if (value!=INT_MIN && s>=0 && symbols[s].kind==sym_text) value-=pc;
+	return value;
+}
+
+/*---------------------------------------------------------
+  directive handles the lines that start with '.'
+  		.text and .data switch sections, .word <value>[,...]
+  		and .space <words> add words to the data section,
+  		and .equ <name>,<number> defines a name
+---------------------------------------------------------*/
+void directive(char *line,int lnum,int ntokens,char *token[],int tokenPos[],int textObj,int quiet) {
+	char *d=token[0];
+	if (0==strcmp(d,".text") || 0==strcmp(d,".data")) {
+		inData=(d[1]=='d');
+		if (ntokens>1) printEmsg(line,lnum,tokenPos[1],"Extra tokens ignored");
+		return;
+	}
+	if (0==strcmp(d,".equ")) {
+		if (ntokens<3) {
+			printEmsg(line,lnum,tokenPos[ntokens-1],"Missing name or value");
+			return;
+		}
+		int value=getNumber(token[2]);
+		if (value==INT_MIN) {
+			printEmsg(line,lnum,tokenPos[2],"Invalid value");
+			return;
+		}
+		defineSymbol(line,lnum,tokenPos[1],token[1],value,sym_equ);
+		if (ntokens>3) printEmsg(line,lnum,tokenPos[3],"Extra tokens ignored");
+		return;
+	}
+	if (0!=strcmp(d,".word") && 0!=strcmp(d,".space")) {
+		printEmsg(line,lnum,tokenPos[0],"Unknown directive");
+		return;
+	}
+	// The checks below give the same result in both passes, so labels stay put
+	if (!inData) {
+		printEmsg(line,lnum,tokenPos[0],"Data directive outside the .data section");
+		return;
+	}
+	if (textObj) {
+		printEmsg(line,lnum,tokenPos[0],"Data needs a binary object... assemble without -t");
+		return;
+	}
+	if (ntokens<2) {
+		printEmsg(line,lnum,tokenPos[0],"Missing value");
+		return;
+	}
+	int start=objDataCount;
+	if (d[1]=='w') {
+		for(int t=1;t<ntokens;t++) {
+			int value=0;
+			if (asmPass==2) { // Pass 1 only counts the words
+				value=getValue(token[t]);
+				if (value==INT_MIN) {
+					printEmsg(line,lnum,tokenPos[t],"Invalid value or undefined label");
+					value=0;
+				}
+			}
+			addData(value);
+		}
+	} else {
+		int words=getNumber(token[1]);
+		if (words==INT_MIN || words<0) {
+			printEmsg(line,lnum,tokenPos[1],"Invalid number of words");
+			return;
+		}
+		for(int w=0;w<words;w++) addData(0);
+		if (ntokens>2) printEmsg(line,lnum,tokenPos[2],"Extra tokens ignored");
+	}
+	int words=objDataCount-start;
+	if (asmPass==2 && !quiet) printf(" %3d=M%04x | %d word%s | %s\n",lnum,4*start,words,words==1?"":"s",line);
+}
+
+/*---------------------------------------------------------
+  defineSymbol adds a label or .equ name in pass 1, and
+  		reports names defined twice in pass 2
+---------------------------------------------------------*/
+void defineSymbol(char *line,int lnum,int col,char *name,int value,int kind) {
+	if (!validSymbol(name)) {
+		printEmsg(line,lnum,col,"Invalid name... use letters, digits and _, not a register");
+		return;
+	}
+	int s=findSymbol(name);
+	if (s>=0) {
+		if (symbols[s].lineNum!=lnum) {
+			char msg[80];
+			sprintf(msg,"Duplicate name (first defined on line %d)",symbols[s].lineNum);
+			printEmsg(line,lnum,col,msg);
+		}
+		return;
+	}
+	if (symCount==symSize) {
+		symSize=symSize?symSize*2:256;
+		symbols=realloc(symbols,symSize*sizeof(struct symbol_struct));
+	}
+	symbols[symCount].name=addString(name);
+	symbols[symCount].value=value;
+	symbols[symCount].lineNum=lnum;
+	symbols[symCount].kind=kind;
+	symCount++;
+	if (2*symCount>symHashSize) {
+		// Grow and rebuild the hash table
+		symHashSize=symHashSize?symHashSize*2:512;
+		free(symHash);
+		symHash=malloc(symHashSize*sizeof(int));
+		memset(symHash,0xff,symHashSize*sizeof(int)); // all -1
+		for(int i=0;i<symCount;i++) hashSymbol(i);
+	} else hashSymbol(symCount-1);
+}
+
+/*---------------------------------------------------------
+  findSymbol returns the index of a name in symbols, or -1
+---------------------------------------------------------*/
+int findSymbol(const char *name) {
+	if (symHashSize==0) return -1;
+	unsigned int h=hashName(name)&(symHashSize-1);
+	while(symHash[h]>=0) {
+		if (0==strcmp(objStrings+symbols[symHash[h]].name,name)) return symHash[h];
+		h=(h+1)&(symHashSize-1);
+	}
+	return -1;
+}
+
+void hashSymbol(int s) {
+	unsigned int h=hashName(objStrings+symbols[s].name)&(symHashSize-1);
+	while(symHash[h]>=0) h=(h+1)&(symHashSize-1);
+	symHash[h]=s;
+}
+
+unsigned int hashName(const char *name) {
+	unsigned int h=2166136261u; // FNV-1a
+	while(*name) h=(h^(unsigned char)*name++)*16777619u;
+	return h;
+}
+
+int validSymbol(const char *name) {
+	if (!isalpha((int)name[0]) && name[0]!='_') return 0;
+	for(const char *p=name+1;*p;p++) {
+		if (!isalnum((int)*p) && *p!='_') return 0;
+	}
+	if (toupper(name[0])=='R' && name[1]!=0x00 && strspn(name+1,"0123456789")==strlen(name+1)) return 0;
+	return 1;
+}
+
+/*---------------------------------------------------------
+  addInstruction saves an instruction, and its source line
+  		for the line table, for writeBinary
+---------------------------------------------------------*/
+void addInstruction(int inst,int inum,int lineNum,char *asmLine) {
+	if (objCount==objSize) {
+		objSize=objSize?objSize*2:128;
+		objCode=realloc(objCode,objSize*sizeof(uint32_t));
+		objLines=realloc(objLines,objSize*sizeof(struct apexObjLine_struct));
+	}
+	objCode[objCount]=inst;
+	objLines[objCount].inum=inum;
+	objLines[objCount].srcLine=lineNum;
+	objLines[objCount].text=addString(asmLine);
+	objCount++;
+}
+
+/*---------------------------------------------------------
+  addString copies a string to the string table, and
+  		returns its offset
+---------------------------------------------------------*/
+int addString(const char *string) {
+	int ll=strlen(string)+1;
+	while (objStrBytes+ll>objStrSize) {
+		objStrSize=objStrSize?objStrSize*2:4096;
+		objStrings=realloc(objStrings,objStrSize);
+	}
+	memcpy(objStrings+objStrBytes,string,ll);
+	objStrBytes+=ll;
+	return objStrBytes-ll;
+}
+
+/*---------------------------------------------------------
+  addData adds a word to the data section (in pass 1, it
+  		only counts the word)
+---------------------------------------------------------*/
+void addData(int value) {
+	if (asmPass==2) {
+		if (objDataCount==objDataSize) {
+			objDataSize=objDataSize?objDataSize*2:1024;
+			objData=realloc(objData,objDataSize*sizeof(int32_t));
+		}
+		objData[objDataCount]=value;
+	}
+	objDataCount++;
+}
+
+/*---------------------------------------------------------
+  writeBinary writes the saved instructions as a binary
+  		object file. Returns 0 if successful.
+---------------------------------------------------------*/
+int writeBinary(FILE *objF) {
+	struct apexObjHeader_struct hdr={
+		.magic=APEXOBJ_MAGIC,.version=APEXOBJ_VERSION,
+		.codeAddr=0x4000,.codeWords=objCount,
+		.dataAddr=0,.dataWords=objDataCount,
+		.numLines=objCount,.numSymbols=symCount,.strBytes=objStrBytes };
+	if (1!=fwrite(&hdr,sizeof(hdr),1,objF)) return 1;
+	if (objCount!=fwrite(objCode,sizeof(uint32_t),objCount,objF)) return 1;
+	if (objDataCount!=fwrite(objData,sizeof(int32_t),objDataCount,objF)) return 1;
+	if (objCount!=fwrite(objLines,sizeof(struct apexObjLine_struct),objCount,objF)) return 1;
+	for(int s=0;s<symCount;s++) {
+		struct apexObjSymbol_struct sym={ .value=symbols[s].value,.name=symbols[s].name };
+		if (1!=fwrite(&sym,sizeof(sym),1,objF)) return 1;
+	}
+	if (objStrBytes!=fwrite(objStrings,1,objStrBytes,objF)) return 1;
+	return 0;
+}
+
+void freeObject() {
+	free(objCode);
+	free(objLines);
+	free(objStrings);
+	free(objData);
+	free(symbols);
+	free(symHash);
 }
 
 /*---------------------------------------------------------
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "apexCPU.h"
+#include "apexFunc.h"
+#include "apexMem.h"
+#include "apexProf.h"
+
+/*---------------------------------------------------------
+This file contains a batch driver that simulates many
+independent jobs on a fixed size pool of threads. A job
+is either an object file, or one object file with one of
+many initial data memory images.
+
+Each worker owns a deque, a block of consecutive job
+numbers. A worker takes jobs from the back of its own
+deque, and when that is empty, steals from the front of
+the other deques, so long and short jobs balance across
+the pool.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+  Data structures
+---------------------------------------------------------*/
+struct job_struct {
+	char *objFile;
+	char *dataFile; // NULL if no data image
+	// Results
+	int loaded;
+	int cycles;
+	int retired;
+	int halted;
+	int stop;
+	char abend[64];
+};
+
+struct deque_struct {
+	pthread_mutex_t lock;
+	int head; // next job number to steal
+	int tail; // one past the next job number for the owner
+};
+
+struct pool_struct {
+	struct job_struct *jobs;
+	struct deque_struct *deques;
+	int nworkers;
+	int maxCycles;
+	int functional;
+	unsigned int memSize;
+};
+
+struct worker_struct {
+	struct pool_struct *pool;
+	int id;
+};
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void * worker(void *arg);
+int takeJob(struct pool_struct *pool,int id);
+void runJob(struct pool_struct *pool,cpu cpu,struct job_struct *job);
+int readList(char *listFile,char ***names);
+
+/*---------------------------------------------------------
+  Main function
+---------------------------------------------------------*/
+int main(int argc,char **argv) {
+	int nworkers=sysconf(_SC_NPROCESSORS_ONLN);
+	int maxCycles=0;
+	int functional=0;
+	unsigned int memSize=DEFAULT_MEMSIZE;
+	int dataMode=0; // first file is the program, the rest are data images
+	char *listFile=NULL;
+	int posArg=1;
+	while (argc>posArg && argv[posArg][0]=='-') {
+		if (0==strcmp(argv[posArg],"-h")) {
+			printf("APEX batch simulator\n");
+			printf("Invoke as: %s [-j <threads>] [--max-cycles <n>] [--functional] [--mem-size <bytes>] <objFile>...\n",argv[0]);
+			printf("       or: %s [options] --data <objFile> <dataFile>...\n",argv[0]);
+			printf("Each object file (or each data file, loaded into data memory from address 0)\n");
+			printf("   is simulated as an independent job with no per-cycle output.\n");
+			printf("   -f <listFile> reads more file names, one per line.\n");
+			printf("One stats line is printed per job. Exit code is 0 if every job retired HALT.\n");
+			return 0;
+		} else if (0==strcmp(argv[posArg],"-j") && argc>posArg+1) {
+			nworkers=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--max-cycles") && argc>posArg+1) {
+			maxCycles=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--mem-size") && argc>posArg+1) {
+			memSize=strtoul(argv[++posArg],NULL,0)&~3u;
+		} else if (0==strcmp(argv[posArg],"--functional")) {
+			functional=1;
+		} else if (0==strcmp(argv[posArg],"--data")) {
+			dataMode=1;
+		} else if (0==strcmp(argv[posArg],"-f") && argc>posArg+1) {
+			listFile=argv[++posArg];
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
+		}
+		posArg++;
+	}
+	if (nworkers<1) nworkers=1;
+
+	// Collect the file names
+	char **names=NULL;
+	int nnames=0;
+	if (listFile) {
+		nnames=readList(listFile,&names);
+		if (nnames<0) return 1;
+	}
+	int nlisted=nnames; // names[0..nlisted-1] are malloc'd by readList
+	names=realloc(names,(nnames+argc)*sizeof(char *));
+	for(int a=posArg;a<argc;a++) names[nnames++]=argv[a];
+
+	char *program=NULL;
+	if (dataMode) {
+		if (nnames<1) {
+			printf("Error - --data requires an object file name\n");
+			return 1;
+		}
+		program=names[0];
+	}
+	int njobs=nnames-dataMode;
+	if (njobs<1) {
+		printf("Error - nothing to simulate. Use -h for help.\n");
+		return 1;
+	}
+	if (nworkers>njobs) nworkers=njobs;
+
+	struct pool_struct pool;
+	pool.jobs=calloc(njobs,sizeof(struct job_struct));
+	pool.deques=malloc(nworkers*sizeof(struct deque_struct));
+	pool.nworkers=nworkers;
+	pool.maxCycles=maxCycles;
+	pool.functional=functional;
+	pool.memSize=memSize;
+	for(int j=0;j<njobs;j++) {
+		pool.jobs[j].objFile=dataMode?program:names[j];
+		pool.jobs[j].dataFile=dataMode?names[j+1]:NULL;
+	}
+	for(int w=0;w<nworkers;w++) {
+		pthread_mutex_init(&pool.deques[w].lock,NULL);
+		pool.deques[w].head=(int)(((long)njobs*w)/nworkers);
+		pool.deques[w].tail=(int)(((long)njobs*(w+1))/nworkers);
+	}
+
+	struct timespec start,end;
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	pthread_t *threads=malloc(nworkers*sizeof(pthread_t));
+	struct worker_struct *workers=malloc(nworkers*sizeof(struct worker_struct));
+	for(int w=0;w<nworkers;w++) {
+		workers[w].pool=&pool;
+		workers[w].id=w;
+		pthread_create(&threads[w],NULL,worker,&workers[w]);
+	}
+	for(int w=0;w<nworkers;w++) pthread_join(threads[w],NULL);
+	clock_gettime(CLOCK_MONOTONIC,&end);
+	double secs=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+
+	// Report in job order
+	int failed=0;
+	long totalCycles=0;
+	for(int j=0;j<njobs;j++) {
+		struct job_struct *job=&pool.jobs[j];
+		char *reason;
+		if (!job->loaded) reason="load failed";
+		else if (job->stop) reason=job->abend;
+		else reason=functional?"instruction budget exhausted":"cycle budget exhausted";
+		if (!job->halted) failed++;
+		totalCycles+=job->cycles;
+		printf("%s%s%s",job->objFile,job->dataFile?" ":"",job->dataFile?job->dataFile:"");
+		if (functional) printf(" retired=%d",job->retired); // no cycles to report
+		else printf(" cycles=%d retired=%d IPC=%5.3f",job->cycles,job->retired,
+			job->cycles?((float)job->retired)/job->cycles:0.0);
+		printf(" stop=%s\n",reason);
+	}
+	printf("%d jobs, %d did not retire HALT, %d threads, %.3f seconds, %.0f jobs/second",
+		njobs,failed,nworkers,secs,secs>0?njobs/secs:0.0);
+	if (!functional && secs>0) printf(", %.0f cycles/second",totalCycles/secs);
+	printf("\n");
+
+	for(int w=0;w<nworkers;w++) pthread_mutex_destroy(&pool.deques[w].lock);
+	free(threads);
+	free(workers);
+	free(pool.deques);
+	free(pool.jobs);
+	for(int i=0;i<nlisted;i++) free(names[i]);
+	free(names);
+	return failed?1:0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+
+void * worker(void *arg) {
+	struct worker_struct *me=arg;
+	struct apexCPU_struct *apexCPU=malloc(sizeof(struct apexCPU_struct));
+	int j;
+	while((j=takeJob(me->pool,me->id))>=0) {
+		runJob(me->pool,apexCPU,&me->pool->jobs[j]);
+	}
+	free(apexCPU);
+	return NULL;
+}
+
+int takeJob(struct pool_struct *pool,int id) {
+	// Returns the next job number for worker id, or -1 when all jobs are taken
+	struct deque_struct *dq=&pool->deques[id];
+	int j=-1;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head<dq->tail) j=--dq->tail;
+	pthread_mutex_unlock(&dq->lock);
+	if (j>=0) return j;
+	// Own deque is empty... steal from the front of another one
+	for(int i=1;i<pool->nworkers && j<0;i++) {
+		struct deque_struct *victim=&pool->deques[(id+i)%pool->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head<victim->tail) j=victim->head++;
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return j;
+}
+
+void runJob(struct pool_struct *pool,cpu cpu,struct job_struct *job) {
+	initCPU(cpu);
+	cpu->trace=0;
+	cpu->memSize=pool->memSize;
+	if (loadCPU(cpu,job->objFile)>0 && (job->dataFile==NULL || loadData(cpu,job->dataFile)>=0)) {
+		job->loaded=1;
+		if (pool->functional) runFunctional(cpu,pool->maxCycles);
+		else while(!cpu->stop && (pool->maxCycles<=0 || cpu->t<pool->maxCycles)) cycleCPU(cpu);
+		job->cycles=cpu->t;
+		job->retired=pool->functional?cpu->func_retired:cpu->instr_retired;
+		job->halted=cpu->halted;
+		job->stop=cpu->stop;
+		strcpy(job->abend,cpu->abend);
+	}
+	freeProfile(cpu);
+	freeMem(cpu);
+}
+
+
+int readList(char *listFile,char ***names) {
+	// Reads file names, one per line, into a malloc'd array. Returns the count or -1
+	FILE * listF=fopen(listFile,"r");
+	if (listF==NULL) {
+		perror("Error - unable to open list file for read");
+		return -1;
+	}
+	int n=0,size=0;
+	char line[4096];
+	*names=NULL;
+	while(NULL!=fgets(line,sizeof(line),listF)) {
+		int ll=strlen(line);
+		while(ll>0 && (line[ll-1]=='\n' || line[ll-1]=='\r' || line[ll-1]==' ')) line[--ll]='\0';
+		if (ll==0) continue;
+		if (n==size) {
+			size=size?size*2:64;
+			*names=realloc(*names,size*sizeof(char *));
+		}
+		(*names)[n]=malloc(ll+1);
+		strcpy((*names)[n++],line);
+	}
+	fclose(listF);
+	return n;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "apexCPU.h"
+#include "apexFunc.h"
+#include "apexMem.h"
+#include "apexProf.h"
+
+/*---------------------------------------------------------
+This file contains a benchmark driver that measures how
+fast the simulator runs, not how fast the simulated code
+runs.
+
+Each kernel is an APEX program generated with an outer
+loop count n, written to <dir>/<kernel>.s, assembled with
+apexAsm and then simulated headless reps times. The best
+(shortest) host time is reported as simulated cycles and
+instructions per second, and one CSV line per kernel is
+appended to the results file, tagged (with the commit,
+for example) so runs can be compared.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+  Data structures
+---------------------------------------------------------*/
+struct kernelSrc_struct {
+	FILE *f;
+	int n; // number of the next instruction
+};
+
+typedef void (*kernelGen)(struct kernelSrc_struct *k,int n);
+
+struct kernel_struct {
+	char *name;
+	kernelGen gen;
+	int n; // default outer loop count, at most 32767 (MOVC immediate)
+	char *desc;
+};
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+int emit(struct kernelSrc_struct *k,char *fmt,...);
+void emitBranch(struct kernelSrc_struct *k,char *mnemonic,int target);
+void genCountdown(struct kernelSrc_struct *k,int n);
+void genGcd(struct kernelSrc_struct *k,int n);
+void genSweep(struct kernelSrc_struct *k,int n);
+void genMul(struct kernelSrc_struct *k,int n);
+void genBranch(struct kernelSrc_struct *k,int n);
+int buildKernel(struct kernel_struct *kern,int n,char *dir,char *asmPgm,char *objFile);
+double runKernel(cpu cpu,char *objFile,int functional);
+double now();
+
+/*---------------------------------------------------------
+   Global Variables
+---------------------------------------------------------*/
+struct kernel_struct kernels[]={
+	{"countdown",genCountdown,300,"nested countdown loops, 1000 inner iterations"},
+	{"gcd",genGcd,200,"gcd by subtraction of (34i,21i) for i=100..1"},
+	{"sweep",genSweep,100,"LOAD, increment and STORE of 1024 words"},
+	{"mul",genMul,500,"dependent MUL chains, 100 inner iterations"},
+	{"branch",genBranch,1000,"data dependent branches, 100 inner iterations"},
+};
+#define NUMKERNELS (int)(sizeof(kernels)/sizeof(kernels[0]))
+
+/*---------------------------------------------------------
+  Main function
+---------------------------------------------------------*/
+int main(int argc,char **argv) {
+	int reps=3;
+	int functional=0;
+	char *resultsFile=NULL;
+	char *tag="none";
+	char *dir="bench";
+	char *asmPgm="./apexAsm";
+	int posArg=1;
+	while (argc>posArg && argv[posArg][0]=='-') {
+		if (0==strcmp(argv[posArg],"-h")) {
+			printf("APEX simulator benchmarks\n");
+			printf("Invoke as: %s [-r <reps>] [-o <results.csv>] [-t <tag>] [-d <dir>] [-a <apexAsm>]\n",argv[0]);
+			printf("       [--functional] [<kernel>[=<n>]...]\n");
+			printf("Runs each kernel (all by default) headless <reps> times (default 3), and reports the\n");
+			printf("   best host time. Kernel sources and objects are written to <dir> (default bench).\n");
+			printf("With -o, appends one CSV line per kernel, tagged with <tag>, to <results.csv>.\n");
+			printf("Kernels (n is the outer loop count, at most 32767):\n");
+			for(int i=0;i<NUMKERNELS;i++) printf("   %-10s n=%-5d %s\n",kernels[i].name,kernels[i].n,kernels[i].desc);
+			return 0;
+		} else if (0==strcmp(argv[posArg],"-r") && argc>posArg+1) {
+			reps=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"-o") && argc>posArg+1) {
+			resultsFile=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"-t") && argc>posArg+1) {
+			tag=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"-d") && argc>posArg+1) {
+			dir=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"-a") && argc>posArg+1) {
+			asmPgm=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"--functional")) {
+			functional=1;
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
+		}
+		posArg++;
+	}
+	if (reps<1) reps=1;
+
+	// Select the kernels to run, and their loop counts
+	int run[NUMKERNELS];
+	int nRun=0;
+	int selected[NUMKERNELS];
+	for(int i=0;i<NUMKERNELS;i++) selected[i]=(argc<=posArg)?kernels[i].n:0;
+	for(int a=posArg;a<argc;a++) {
+		char *eq=strchr(argv[a],'=');
+		int len=eq?eq-argv[a]:(int)strlen(argv[a]);
+		int i;
+		for(i=0;i<NUMKERNELS;i++) {
+			if ((int)strlen(kernels[i].name)==len && 0==strncmp(kernels[i].name,argv[a],len)) break;
+		}
+		if (i==NUMKERNELS) {
+			printf("Unknown kernel: %s. Use -h for the list.\n",argv[a]);
+			return 1;
+		}
+		selected[i]=eq?atoi(eq+1):kernels[i].n;
+		if (selected[i]<1 || selected[i]>32767) {
+			printf("Loop count for %s must be from 1 to 32767\n",kernels[i].name);
+			return 1;
+		}
+	}
+	for(int i=0;i<NUMKERNELS;i++) if (selected[i]) run[nRun++]=i;
+
+	mkdir(dir,0777);
+	FILE *resF=NULL;
+	if (resultsFile) {
+		struct stat st;
+		int fresh=(0!=stat(resultsFile,&st) || st.st_size==0);
+		resF=fopen(resultsFile,"a");
+		if (resF==NULL) {
+			perror("Error - unable to open results file for append");
+			return 1;
+		}
+		if (fresh) fprintf(resF,"tag,date,kernel,n,engine,cycles,instructions,seconds,cycles_per_second,instructions_per_second\n");
+	}
+	char date[32];
+	time_t t=time(NULL);
+	strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%S",localtime(&t));
+
+	printf("%-10s %6s %10s %10s %9s %14s %14s\n","kernel","n","cycles","instrs","seconds","cycles/second","instrs/second");
+	struct apexCPU_struct apexCPU;
+	int failed=0;
+	for(int r=0;r<nRun;r++) {
+		struct kernel_struct *kern=&kernels[run[r]];
+		int n=selected[run[r]];
+		char objFile[256];
+		if (0!=buildKernel(kern,n,dir,asmPgm,objFile)) {
+			failed++;
+			continue;
+		}
+		double best=-1;
+		int cycles=0,instrs=0,halted=1;
+		for(int i=0;i<reps;i++) {
+			initCPU(&apexCPU);
+			apexCPU.trace=0;
+			double secs=runKernel(&apexCPU,objFile,functional);
+			if (secs>=0 && (best<0 || secs<best)) best=secs;
+			cycles=apexCPU.t;
+			instrs=functional?apexCPU.func_retired:apexCPU.instr_retired;
+			halted=halted && apexCPU.halted;
+			freeProfile(&apexCPU);
+			freeMem(&apexCPU);
+		}
+		if (best<0 || !halted) {
+			printf("%-10s %6d did not run to HALT\n",kern->name,n);
+			failed++;
+			continue;
+		}
+		double cps=(best>0 && !functional)?cycles/best:0;
+		double ips=best>0?instrs/best:0;
+		printf("%-10s %6d %10d %10d %9.4f %14.0f %14.0f\n",kern->name,n,cycles,instrs,best,cps,ips);
+		fflush(stdout);
+		if (resF) {
+			fprintf(resF,"%s,%s,%s,%d,%s,%d,%d,%.6f,%.0f,%.0f\n",tag,date,kern->name,n,
+				functional?"functional":"pipeline",cycles,instrs,best,cps,ips);
+		}
+	}
+	if (resF) fclose(resF);
+	return failed?1:0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+int emit(struct kernelSrc_struct *k,char *fmt,...) {
+	// Writes one instruction, returns its instruction number
+	va_list args;
+	va_start(args,fmt);
+	vfprintf(k->f,fmt,args);
+	va_end(args);
+	fprintf(k->f,"\n");
+	return k->n++;
+}
+
+void emitBranch(struct kernelSrc_struct *k,char *mnemonic,int target) {
+	// Branch offsets are relative to the branch's own pc
+	emit(k,"%s #%d",mnemonic,4*(target-k->n));
+}
+
+void genCountdown(struct kernelSrc_struct *k,int n) {
+	emit(k,"MOVC R9,#%d",n);
+	int outer=emit(k,"MOVC R1,#1000");
+	int inner=emit(k,"SUBL R1,R1,#1");
+	emitBranch(k,"BNZ",inner);
+	emit(k,"SUBL R9,R9,#1");
+	emitBranch(k,"BNZ",outer);
+	emit(k,"HALT");
+}
+
+void genGcd(struct kernelSrc_struct *k,int n) {
+	// (34i,21i) are consecutive Fibonacci multiples, 8 subtractions each
+	emit(k,"MOVC R9,#%d",n);
+	int outer=emit(k,"MOVC R4,#100");
+	int pair=emit(k,"MOVC R5,#34");
+	emit(k,"MUL R0,R4,R5");
+	emit(k,"MOVC R5,#21");
+	emit(k,"MUL R1,R4,R5");
+	int compare=emit(k,"CMP R1,R0");
+	emitBranch(k,"BP",compare+5); // r1>r0, skip the swap
+	emit(k,"ADDL R2,R1,#0");
+	emit(k,"ADDL R1,R0,#0");
+	emit(k,"ADDL R0,R2,#0");
+	emit(k,"SUB R1,R1,R0");
+	emitBranch(k,"BNP",k->n+2); // zero, gcd is in R0
+	emitBranch(k,"JUMP",compare);
+	emit(k,"SUBL R4,R4,#1");
+	emitBranch(k,"BNZ",pair);
+	emit(k,"SUBL R9,R9,#1");
+	emitBranch(k,"BNZ",outer);
+	emit(k,"HALT");
+}
+
+void genSweep(struct kernelSrc_struct *k,int n) {
+	emit(k,"MOVC R9,#%d",n);
+	int outer=emit(k,"MOVC R2,#0");
+	emit(k,"MOVC R3,#1024");
+	int inner=emit(k,"LOAD R1,R2,#0");
+	emit(k,"ADDL R1,R1,#1");
+	emit(k,"STORE R1,R2,#0");
+	emit(k,"ADDL R2,R2,#4");
+	emit(k,"SUBL R3,R3,#1");
+	emitBranch(k,"BNZ",inner);
+	emit(k,"SUBL R9,R9,#1");
+	emitBranch(k,"BNZ",outer);
+	emit(k,"HALT");
+}
+
+void genMul(struct kernelSrc_struct *k,int n) {
+	// Every chain starts over from R1, so the products never overflow
+	emit(k,"MOVC R9,#%d",n);
+	emit(k,"MOVC R1,#3");
+	int outer=emit(k,"MOVC R4,#100");
+	int inner=emit(k,"MUL R2,R1,R1");
+	emit(k,"MUL R3,R2,R1");
+	emit(k,"MUL R5,R3,R2");
+	emit(k,"MUL R6,R5,R1");
+	emit(k,"MUL R7,R6,R3");
+	emit(k,"MUL R8,R7,R5");
+	emit(k,"SUBL R4,R4,#1");
+	emitBranch(k,"BNZ",inner);
+	emit(k,"SUBL R9,R9,#1");
+	emitBranch(k,"BNZ",outer);
+	emit(k,"HALT");
+}
+
+void genBranch(struct kernelSrc_struct *k,int n) {
+	// One branch taken on odd counts, one almost always taken, and the loop branches
+	emit(k,"MOVC R9,#%d",n);
+	emit(k,"MOVC R5,#1");
+	emit(k,"MOVC R7,#0");
+	int outer=emit(k,"MOVC R4,#100");
+	int inner=emit(k,"AND R6,R4,R5");
+	emit(k,"ADDL R6,R6,#0");
+	emitBranch(k,"BZ",k->n+2);
+	emit(k,"ADDL R7,R7,#1");
+	emit(k,"CMP R4,R5");
+	emitBranch(k,"BP",k->n+2);
+	emit(k,"NOP");
+	emit(k,"SUBL R4,R4,#1");
+	emitBranch(k,"BNZ",inner);
+	emit(k,"SUBL R9,R9,#1");
+	emitBranch(k,"BNZ",outer);
+	emit(k,"HALT");
+}
+
+int buildKernel(struct kernel_struct *kern,int n,char *dir,char *asmPgm,char *objFile) {
+	// Writes and assembles <dir>/<kernel>.s, and sets objFile. Returns 0 if successful
+	char srcFile[256],cmd[600];
+	snprintf(srcFile,sizeof(srcFile),"%s/%s.s",dir,kern->name);
+	snprintf(objFile,256,"%s/%s.o",dir,kern->name);
+	struct kernelSrc_struct k={fopen(srcFile,"w"),0};
+	if (k.f==NULL) {
+		perror("Error - unable to open kernel source for write");
+		return -1;
+	}
+	kern->gen(&k,n);
+	fclose(k.f);
+	snprintf(cmd,sizeof(cmd),"%s %s >/dev/null",asmPgm,srcFile);
+	if (0!=system(cmd)) {
+		printf("Error - %s failed to assemble %s\n",asmPgm,srcFile);
+		return -1;
+	}
+	return 0;
+}
+
+double runKernel(cpu cpu,char *objFile,int functional) {
+	// Returns the host seconds to run objFile to a stop, or -1 if it did not load
+	if (loadCPU(cpu,objFile)<=0) return -1;
+	double start=now();
+	if (functional) runFunctional(cpu,0);
+	else while(!cpu->stop) cycleCPU(cpu);
+	return now()-start;
+}
+
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
@@ -1,8 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "apexCPU.h"
 #include "apexMem.h"
+#include "apexObj.h"
+#include "apexProf.h"
 
 /*---------------------------------------------------------
    Internal function declarations
@@ -10,14 +20,20 @@
 void cycle_fetch(cpu cpu);
 void cycle_decode(cpu cpu);
 void cycle_stage(cpu cpu,int stage);
-char * getInum(cpu cpu,int pc);
+char * getInum(cpu cpu,int pc,char *inumBuf);
+void swapStage(cpu cpu,int s1,int s2);
 void reportReg(cpu cpu,int r);
+int loadBinary(cpu cpu,char * objFileName,const void * obj,size_t size);
+int loadText(cpu cpu,char * objFileName);
+int finishLoad(cpu cpu,int nread);
 
 /*---------------------------------------------------------
    Global Variables
 ---------------------------------------------------------*/
+// Index into apexPredecode_struct.fns for the function each stage invokes
+static const int stageFnSlot[18]={-1,0,1,2,3,1,2,3,1,2,3,1,2,3,1,2,3,4};
 char *stageName[18]={"fetch","decode","alu1","alu2","alu3","mul1","mul2","mul3","ldr1","ldr2","ldr3","str1","str2","str3","brz1","brz2","brz3","writeback"};
-extern opStageFn opFns[6][NUMOPS]; // Array of function pointers, one for each stage/opcode combination
+const char *cpiName[NUMCPI]={"pipeline empty","issued","RAW stall","WAW stall","branch bubble","HALT bubble","drain bubble"};
 
 /*---------------------------------------------------------
    External Function definitions
@@ -26,8 +42,6 @@ extern opStageFn opFns[6][NUMOPS]; // Array of function pointers, one for each s
 void initCPU(cpu cpu) {
 	cpu->pc=0x4000;
 	cpu->numInstructions=0;
-	cpu->lowMem=128;
-	cpu->highMem=-1;
 	for(int i=0;i<16;i++) {
 		cpu->reg[i]=0xdeadbeef;
 		cpu->regValid[i]=1; // all registers start out as "valid"
@@ -35,107 +49,166 @@ void initCPU(cpu cpu) {
 	cpu->cc.z=cpu->cc.p=0;
 	cpu->t=0;
 	cpu->instr_retired=0;
+	cpu->func_retired=0;
 	cpu->halt_fetch=0;
+	cpu->drain=0;
 	cpu->stop=0;
+	cpu->halted=0;
+	cpu->trace=1;
+	cpu->stallMask=cpu->busyMask=0;
+	memset(&cpu->perf,0,sizeof(cpu->perf));
 	for(int i=0;i<18;i++) {
-		cpu->stage[i].status=stage_squashed;
-		cpu->stage[i].report[0]='\0';
-		reportStage(cpu,i,"---");
-		cpu->stage[i].instruction=0;
-		cpu->stage[i].opcode=0;
-		cpu->stage[i].pc=-1;
-		cpu->stage[i].branch_taken=0;
-		for(int op=0;op<NUMOPS;op++) opFns[i][op]=NULL;
+		cpu->stage[i]=&cpu->latch[i];
+		setStatus(cpu,i,stage_squashed);
+		cpu->events[i].n=0;
+		reportStage(cpu,i,ev_idle,0,0,0);
+		cpu->stage[i]->instruction=0;
+		cpu->stage[i]->opcode=0;
+		cpu->stage[i]->pc=-1;
+		cpu->stage[i]->pd=NULL;
+		cpu->stage[i]->branch_taken=0;
+		cpu->stage[i]->ccZ=cpu->stage[i]->ccP=-1;
+		cpu->stage[i]->bubble=cpi_empty;
+		cpu->stage[i]->bubblePc=-1;
 	}
 	cpu->ex_fwdBus.valid=0;
 	cpu->mem_fwdBus.valid=0;
 	for(int i=0;i<5;i++) {
 		cpu->pipearr[i]=0;
 	}
-	registerAllOpcodes();
+	cpu->ops=defaultOpTable();
+	cpu->profile=NULL;
+	cpu->srcText=NULL;
+	cpu->profileSize=cpu->srcSize=0;
+	cpu->output=NULL;
+	cpu->outputCtx=NULL;
+	resetHostStats(cpu);
+	initMem(cpu);
 }
 
-void loadCPU(cpu cpu,char * objFileName) {
+int loadCPU(cpu cpu,char * objFileName) {
+	// Returns the number of instructions loaded, or -1 if the load failed
+	//    Binary objects (see apexObj.h) are mapped and copied, anything else is parsed as text
+	int fd=open(objFileName,O_RDONLY);
+	if (fd<0) {
+		cpuError(cpu,"Error - unable to open object file for read");
+		cpuPrintf(cpu,"...Trying to read from object file %s\n",objFileName);
+		return -1;
+	}
+	clearSource(cpu);
+	int nread=-2; // -2 means not a binary object
+	struct stat st;
+	if (0==fstat(fd,&st) && st.st_size>=(off_t)sizeof(struct apexObjHeader_struct)) {
+		void * obj=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (obj!=MAP_FAILED) {
+			if (((const struct apexObjHeader_struct *)obj)->magic==APEXOBJ_MAGIC) {
+				nread=loadBinary(cpu,objFileName,obj,st.st_size);
+			}
+			munmap(obj,st.st_size);
+		}
+	}
+	close(fd);
+	if (nread==-2) nread=loadText(cpu,objFileName);
+	return finishLoad(cpu,nread);
+}
+
+int loadBuffer(cpu cpu,char * name,const void * obj,size_t size) {
+	// Same as loadCPU, for a binary object already in memory... name is only used in messages
+	clearSource(cpu);
+	if (size<sizeof(struct apexObjHeader_struct)
+		|| ((const struct apexObjHeader_struct *)obj)->magic!=APEXOBJ_MAGIC) {
+		cpuPrintf(cpu,"Load aborted, %s is not an APEX binary object\n",name);
+		return -1;
+	}
+	return finishLoad(cpu,loadBinary(cpu,name,obj,size));
+}
+
+int loadData(cpu cpu,char * dataFileName) {
+	// Loads initial data memory from a file of words (decimal or 0x hex)
+	//    starting at address 0. ';' starts a comment to end of line.
+	//    Returns the number of words loaded, or -1 if the load failed
 	char cmtBuf[128];
-	FILE * objF=fopen(objFileName,"r");
-	if (objF==NULL) {
-		perror("Error - unable to open object file for read");
-		printf("...Trying to read from object file %s\n",objFileName);
-		return;
+	FILE * dataF=fopen(dataFileName,"r");
+	if (dataF==NULL) {
+		cpuError(cpu,"Error - unable to open data file for read");
+		cpuPrintf(cpu,"...Trying to read from data file %s\n",dataFileName);
+		return -1;
 	}
 
 	int nread=0;
-	while(!feof(objF)) {
-		int newInst;
-		if (1==fscanf(objF," %08x",&newInst)) {
-			cpu->codeMem[nread++]=newInst;
-		} else if (1==fscanf(objF,"; %127[^\n]\n",cmtBuf)) {
-			// Ignore comments on the same line
-			// printf("Ignoring commment: %s\n",cmtBuf);
-		} else {
-			fscanf(objF," %s ",cmtBuf);
-			printf("Load aborted, unrecognized object code: %s\n",cmtBuf);
-			return;
+	while(!feof(dataF)) {
+		int value;
+		if (1==fscanf(dataF," %i",&value)) {
+			if ((unsigned int)nread>=cpu->memSize/4) {
+				cpuPrintf(cpu,"Data load aborted, %s does not fit in %u bytes of memory\n",dataFileName,cpu->memSize);
+				fclose(dataF);
+				return -1;
+			}
+			dstore(cpu,4*nread++,value);
+		} else if (1==fscanf(dataF," ;%127[^\n]",cmtBuf)) {
+			// Ignore comments
+		} else if (!feof(dataF)) {
+			fscanf(dataF," %127s ",cmtBuf);
+			cpuPrintf(cpu,"Data load aborted, unrecognized data: %s\n",cmtBuf);
+			fclose(dataF);
+			return -1;
 		}
 	}
-	cpu->numInstructions=nread;
-	cpu->pc=0x4000;
-	cpu->halt_fetch=cpu->stop=0;
-	printf("Loaded %d instructions starting at adress 0x4000\n",nread);
+	fclose(dataF);
+	return nread;
 }
 
 void printState(cpu cpu) {
+	HOST_BEGIN(ts);
 
-	printf("\nCPU state at cycle %d, pc=0x%08x, cc.z=%s cc.p=%s\n",
+	cpuPrintf(cpu,"\nCPU state at cycle %d, pc=0x%08x, cc.z=%s cc.p=%s\n",
 		cpu->t,cpu->pc,cpu->cc.z?"true":"false",cpu->cc.p?"true":"false");
 
-	printf("Stage Info:\n");
+	cpuPrintf(cpu,"Stage Info:\n");
 	char instBuf[32];
+	char eventBuf[256];
 	for (int s=0;s<18;s++) {
-		printf("  %10s: pc=%05x %s",stageName[s],cpu->stage[s].pc,disassemble(cpu->stage[s].instruction,instBuf));
-		if (cpu->stage[s].status==stage_squashed) printf(" squashed");
-		if (cpu->stage[s].status==stage_stalled) printf(" stalled");
-		printf(" %s\n",cpu->stage[s].report);
+		cpuPrintf(cpu,"  %10s: pc=%05x %s",stageName[s],cpu->stage[s]->pc,disassemble(cpu->stage[s]->instruction,instBuf));
+		if (cpu->stage[s]->status==stage_squashed) cpuPrintf(cpu," squashed");
+		if (cpu->stage[s]->status==stage_stalled) cpuPrintf(cpu," stalled");
+		cpuPrintf(cpu," %s\n",renderEvents(cpu,s,eventBuf,sizeof(eventBuf)));
 	}
 
-   printf("\n Int Regs: \n   ");
+   cpuPrintf(cpu,"\n Int Regs: \n   ");
    for(int r=0;r<16;r++) reportReg(cpu,r);
-	printf("\n");
+	cpuPrintf(cpu,"\n");
 
-	if ((cpu->lowMem<128) && (cpu->highMem>-1)) {
-		printf("Modified memory:\n");
-		for(int i=cpu->lowMem;i<=cpu->highMem;i++) {
-			printf("MEM[%04x]=%d\n",i*4,cpu->dataMem[i]);
-		}
-		printf("\n");
-	}
+	printWritten(cpu);
 
 	if (cpu->ex_fwdBus.valid) {
-		printf("Forward bus from EX: R%d, value=%d\n",
+		cpuPrintf(cpu,"Forward bus from EX: R%d, value=%d\n",
 			cpu->ex_fwdBus.tag,cpu->ex_fwdBus.value);
 	}
 	if (cpu->mem_fwdBus.valid) {
-		printf("Forward bus from MEM: R%d, value=%d\n",
+		cpuPrintf(cpu,"Forward bus from MEM: R%d, value=%d\n",
 			cpu->mem_fwdBus.tag,cpu->mem_fwdBus.value);
 	}
 
 	if (cpu->halt_fetch) {
-		printf("Instruction fetch is halted.\n");
+		cpuPrintf(cpu,"Instruction fetch is halted.\n");
 	}
 	if (cpu->stop) {
-		printf("CPU is stopped because %s\n",cpu->abend);
+		cpuPrintf(cpu,"CPU is stopped because %s\n",cpu->abend);
 	}
+	HOST_END(cpu,host_print,ts);
 }
 
 void cycleCPU(cpu cpu) {
 	if (cpu->stop) {
-		printf("CPU is stopped for %s. No cycles allowed.\n",cpu->abend);
+		if (cpu->trace) cpuPrintf(cpu,"CPU is stopped for %s. No cycles allowed.\n",cpu->abend);
 		return;
 	}
+	HOST_BEGIN(tsCycle);
+	HOST_BEGIN(ts);
 
 	// Move register information down one stage
 	//    backwards so that you don't overwrite
-	if (cpu->stage[writeback].status==stage_stalled) {
+	if (cpu->stallMask & (1u<<writeback)) {
 		cpu->stop=1;
 		strcpy(cpu->abend,"Writeback stalled - no progress possible");
 	} 
@@ -147,141 +220,60 @@ void cycleCPU(cpu cpu) {
 			c++;
 		}
 		
+		if (c<4) cpu->perf.wbConflict++;
 		if (c==5)
 		{
-			cpu->stage[writeback].status = stage_squashed;
-			cpu->stage[writeback].instruction = 0;
-			cpu->stage[writeback].opcode = 0;
-		}
-		
-		if(cpu->pipearr[0]==0)
-		{
-			cpu->stage[alu3] = cpu->stage[alu2];
-			cpu->stage[alu2] = cpu->stage[alu1];
-		}
-		
-		if(cpu->pipearr[0]==1)
-		{
-			cpu->stage[writeback] = cpu->stage[alu3];
-			cpu->stage[alu3] = cpu->stage[alu2];
-			cpu->stage[alu2] = cpu->stage[alu1];
-			cpu->pipearr[0]=0;
-		}
-		
-		if(cpu->pipearr[1]==0)
-		{
-			cpu->stage[mul3] = cpu->stage[mul2];
-			cpu->stage[mul2] = cpu->stage[mul1];
-		}
-		
-		if(cpu->pipearr[1]==1)
-		{
-			cpu->stage[writeback] = cpu->stage[mul3];
-			cpu->stage[mul3] = cpu->stage[mul2];
-			cpu->stage[mul2] = cpu->stage[mul1];
-			cpu->pipearr[1]=0;
+			setStatus(cpu,writeback,stage_squashed);
+			cpu->stage[writeback]->instruction = 0;
+			cpu->stage[writeback]->opcode = 0;
 		}
 		
-		if(cpu->pipearr[2]==0)
-		{
-			cpu->stage[ldr3] = cpu->stage[ldr2];
-			cpu->stage[ldr2] = cpu->stage[ldr1];
-		}
-		
-		if(cpu->pipearr[2]==1)
-		{
-			cpu->stage[writeback] = cpu->stage[ldr3];
-			cpu->stage[ldr3] = cpu->stage[ldr2];
-			cpu->stage[ldr2] = cpu->stage[ldr1];
-			cpu->pipearr[2]=0;
-		}
-		
-		if(cpu->pipearr[3]==0)
-		{
-			cpu->stage[str3] = cpu->stage[str2];
-			cpu->stage[str2] = cpu->stage[str1];
-		}
-		
-		if(cpu->pipearr[3]==1)
-		{
-			cpu->stage[writeback] = cpu->stage[str3];
-			cpu->stage[str3] = cpu->stage[str2];
-			cpu->stage[str2] = cpu->stage[str1];
-			cpu->pipearr[3]=0;
-		}
-		
-		if(cpu->pipearr[4]==0)
-		{
-			cpu->stage[brz3] = cpu->stage[brz2];
-			cpu->stage[brz2] = cpu->stage[brz1];
-		}
-		
-		if(cpu->pipearr[4]==1)
-		{
-			cpu->stage[writeback] = cpu->stage[brz3];
-			cpu->stage[brz3] = cpu->stage[brz2];
-			cpu->stage[brz2] = cpu->stage[brz1];
-			cpu->pipearr[4]=0;
-		}
-		
-		if(cpu->stage[decode].func == alu && cpu->stage[decode].status != stage_stalled)
-		{
-				cpu->stage[alu1] = cpu->stage[decode];
-		}
-		else 
-		{
-				cpu->stage[alu1].status = stage_squashed;
-				cpu->stage[alu1].instruction = 0;
-				cpu->stage[alu1].opcode = 0;
-		}
-		
-		if(cpu->stage[decode].func == mul && cpu->stage[decode].status != stage_stalled)
-		{
-				cpu->stage[mul1] = cpu->stage[decode];
-		}
-		else
-		{
-				cpu->stage[mul1].status = stage_squashed;
-				cpu->stage[mul1].instruction = 0;
-				cpu->stage[mul1].opcode = 0;
-		}
-		
-		if(cpu->stage[decode].func == str && cpu->stage[decode].status != stage_stalled)
-		{
-				cpu->stage[str1] = cpu->stage[decode];
-				
-		}
-		else
-		{
-				cpu->stage[str1].status = stage_squashed;
-				cpu->stage[str1].instruction = 0;
-				cpu->stage[str1].opcode = 0;
-		}
-		
-		if(cpu->stage[decode].func == ldr && cpu->stage[decode].status != stage_stalled)
-		{
-				cpu->stage[ldr1] = cpu->stage[decode];
+		// Advance each FU pipeline by rotating the latch pointers
+		//    X3 goes to writeback if it finished (pipearr), X2->X3, X1->X2
+		for(int fu=alu;fu<=brz;fu++) {
+			int s1=fuStage1(fu);
+			if (!(cpu->busyMask & (7u<<s1)) && cpu->pipearr[fu]==0) continue; // Nothing in this FU to advance
+			if(cpu->pipearr[fu]==1)
+			{
+				swapStage(cpu,writeback,s1+2);
+				cpu->pipearr[fu]=0;
+			}
+			swapStage(cpu,s1+2,s1+1);
+			swapStage(cpu,s1+1,s1);
 		}
-		else
-		{
-				cpu->stage[ldr1].status = stage_squashed;
-				cpu->stage[ldr1].instruction = 0;
-				cpu->stage[ldr1].opcode = 0;
+
+		// Issue from decode to the first stage of its FU, squash the other first stages
+		int issue=(cpu->stage[decode]->status != stage_stalled);
+		int issueFU=cpu->stage[decode]->func; // decode latch changes after the swap
+		int bucket=cpi_issue;
+		int culprit=cpu->stage[decode]->pc; // instruction the cycle is charged to
+		if (!(cpu->busyMask & (1u<<decode))) {
+			bucket=cpu->stage[decode]->bubble;
+			culprit=cpu->stage[decode]->bubblePc;
 		}
-		
-		if(cpu->stage[decode].func == brz && cpu->stage[decode].status != stage_stalled)
-		{
-				cpu->stage[brz1] = cpu->stage[decode];
+		else if (!issue) {
+			bucket=cpu->perf.decodeStall;
+			int *regStall=(bucket==cpi_waw)?cpu->perf.wawStall:cpu->perf.rawStall;
+			regStall[cpu->perf.decodeStallReg]++;
 		}
-		else
-		{
-				cpu->stage[brz1].status = stage_squashed;
-				cpu->stage[brz1].instruction = 0;
-				cpu->stage[brz1].opcode = 0;
+		else cpu->perf.fuIssued[issueFU]++;
+		cpu->perf.cpi[bucket]++;
+		if (cpu->profile) chargeCycle(cpu,culprit,bucket);
+		for(int fu=alu;fu<=brz;fu++) {
+			int s1=fuStage1(fu);
+			if(issue && issueFU == fu)
+			{
+				swapStage(cpu,s1,decode);
+			}
+			else
+			{
+				setStatus(cpu,s1,stage_squashed);
+				cpu->stage[s1]->instruction = 0;
+				cpu->stage[s1]->opcode = 0;
+			}
 		}
-		
-		if(cpu->stage[decode].status != stage_stalled)
-		cpu->stage[decode] = cpu->stage[fetch];
+
+		if(issue) swapStage(cpu,decode,fetch);
 		
 	}
 
@@ -291,200 +283,483 @@ void cycleCPU(cpu cpu) {
 	} else cpu->mem_fwdBus.valid=0;
 	cpu->ex_fwdBus.valid=0;
 
-	// Reset the reports and status as required for all stages
+	// Reset the events and status as required for all stages
 	for(int s=0;s<18;s++) {
-		cpu->stage[s].report[0]='\0';
-		switch (cpu->stage[s].status) {
+		cpu->events[s].n=0;
+		if (!(cpu->busyMask & (1u<<s))) continue; // squashed
+		switch (cpu->stage[s]->status) {
 			case stage_squashed:
 			case stage_stalled:
 			case stage_noAction:
 				break; // No change required
 			case stage_actionComplete:
-				cpu->stage[s].status=stage_noAction; // Overwrite previous stages status
+				setStatus(cpu,s,stage_noAction); // Overwrite previous stages status
 		}
 	}
 
-	// Cycle all eighteen stages
-	if (!cpu->stop) cycle_fetch(cpu);
-	if (!cpu->stop) cycle_decode(cpu); // Do the decode part of d/rf
-	if (!cpu->stop) cycle_stage(cpu,alu1);
-	if (!cpu->stop) cycle_stage(cpu,alu2);
-	if (!cpu->stop) cycle_stage(cpu,alu3);
-	if (!cpu->stop) cycle_stage(cpu,mul1);
-	if (!cpu->stop) cycle_stage(cpu,mul2);
-	if (!cpu->stop) cycle_stage(cpu,mul3);
-	if (!cpu->stop) cycle_stage(cpu,ldr1);
-	if (!cpu->stop) cycle_stage(cpu,ldr2);
-	if (!cpu->stop) cycle_stage(cpu,ldr3);
-	if (!cpu->stop) cycle_stage(cpu,str1);
-	if (!cpu->stop) cycle_stage(cpu,str2);
-	if (!cpu->stop) cycle_stage(cpu,str3);
-	if (!cpu->stop) cycle_stage(cpu,brz1);
-	if (!cpu->stop) cycle_stage(cpu,brz2);
-	if (!cpu->stop) cycle_stage(cpu,brz3);
-	if (!cpu->stop) cycle_stage(cpu,writeback);
-
-	if (!cpu->stop) cycle_stage(cpu,decode); // Do the rf part of d/rf
+	HOST_END(cpu,host_advance,ts);
+
+	// Cycle all eighteen stages... squashed stages have nothing to do
+	if (!cpu->stop) {
+		HOST_BEGIN(tsFetch);
+		cycle_fetch(cpu);
+		HOST_END(cpu,host_fetch,tsFetch);
+	}
+	if (!cpu->stop) {
+		HOST_BEGIN(tsDecode);
+		cycle_decode(cpu); // Do the decode part of d/rf
+		HOST_END(cpu,host_decode,tsDecode);
+	}
+	for(int s=alu1;s<=writeback && !cpu->stop;s++) {
+		if (cpu->busyMask & (1u<<s)) {
+			HOST_BEGIN(tsStage);
+			cycle_stage(cpu,s);
+			HOST_END(cpu,host_stage+s,tsStage);
+		}
+	}
+
+	if (!cpu->stop) {
+		HOST_BEGIN(tsStage);
+		cycle_stage(cpu,decode); // Do the rf part of d/rf
+		HOST_END(cpu,host_stage+decode,tsStage);
+	}
+
+	HOST_BEGIN(tsPerf);
+	for(unsigned int m=cpu->stallMask;m;m&=m-1) cpu->perf.stageStall[__builtin_ctz(m)]++;
+	for(int fu=alu;fu<=brz;fu++) {
+		if (cpu->busyMask & (7u<<fuStage1(fu))) cpu->perf.fuBusy[fu]++;
+	}
+	HOST_END(cpu,host_perf,tsPerf);
 
 	cpu->t++; // update the clock tick - This cycle has completed
+	if (!cpu->trace) { // Headless - no pipeline diagram
+		HOST_END(cpu,host_cycle,tsCycle);
+		return;
+	}
+	HOST_BEGIN(tsPrint);
+
 	if (cpu->t==1) {
-		printf("      |ftch|deco|alu1|alu2|alu3|mul1|mul2|mul3|lod1|lod2|lod3|sto1|sto2|sto3|br1 |br2 |br3 | wb |\n");
+		cpuPrintf(cpu,"      |ftch|deco|alu1|alu2|alu3|mul1|mul2|mul3|lod1|lod2|lod3|sto1|sto2|sto3|br1 |br2 |br3 | wb |\n");
 	}
 
 	// Report on all eighteen stages (move this before cycling the rf part of decode to match Kanad's results)
-	printf ("t=%3d |",cpu->t);
+	cpuPrintf(cpu,"t=%3d |",cpu->t);
+	char inumBuf[16];
 	for(int s=0;s<18;s++) {
-		int stalled=0;
-		for(int f=s;f<18;f++) if (cpu->stage[f].status==stage_stalled) stalled=1;
-		if (stalled) printf ("%3ss|", getInum(cpu,cpu->stage[s].pc));
+		int stalled=(cpu->stallMask>>s)!=0; // this or any later stage stalled
+		if (stalled) cpuPrintf(cpu,"%3ss|", getInum(cpu,cpu->stage[s]->pc,inumBuf));
 		else {
-			switch(cpu->stage[s].status) {
-				case stage_squashed: printf("   q|"); break;
+			switch(cpu->stage[s]->status) {
+				case stage_squashed: cpuPrintf(cpu,"   q|"); break;
 				case stage_stalled: break; // printed stalled above
-				case stage_noAction: printf ("%3s-|", getInum(cpu,cpu->stage[s].pc)); break;
-				case stage_actionComplete: printf("%3s+|", getInum(cpu,cpu->stage[s].pc)); break;
+				case stage_noAction: cpuPrintf(cpu,"%3s-|", getInum(cpu,cpu->stage[s]->pc,inumBuf)); break;
+				case stage_actionComplete: cpuPrintf(cpu,"%3s+|", getInum(cpu,cpu->stage[s]->pc,inumBuf)); break;
 			}
 		}
 
 	}
-	printf("\n");
+	cpuPrintf(cpu,"\n");
 
 	// if (!cpu->stop) cycle_stage(cpu,decode); // Do the rf part of d/rf
 
 	if (cpu->stop) {
-		printf("CPU stopped because %s\n",cpu->abend);
+		cpuPrintf(cpu,"CPU stopped because %s\n",cpu->abend);
 	}
+	HOST_END(cpu,host_print,tsPrint);
+	HOST_END(cpu,host_cycle,tsCycle);
 }
 
 void printStats(cpu cpu) {
-	printf("\nAPEX Simulation complete.\n");
-	printf("    Total cycles executed: %d\n",cpu->t);
-	printf("    Instructions retired: %d\n",cpu->instr_retired);
-	printf("    Instructions per Cycle (IPC): %5.3f\n",((float)cpu->instr_retired)/cpu->t);
-	printf("    Stop is %s\n",cpu->stop?"true":"false");
+	cpuPrintf(cpu,"\nAPEX Simulation complete.\n");
+	cpuPrintf(cpu,"    Total cycles executed: %d\n",cpu->t);
+	cpuPrintf(cpu,"    Instructions retired: %d\n",cpu->instr_retired);
+	if (cpu->t>0) cpuPrintf(cpu,"    Instructions per Cycle (IPC): %5.3f\n",((float)cpu->instr_retired)/cpu->t);
+	if (cpu->func_retired>0) cpuPrintf(cpu,"    Instructions executed functionally: %d\n",cpu->func_retired);
+	cpuPrintf(cpu,"    Stop is %s\n",cpu->stop?"true":"false");
 	if (cpu->stop) {
-		printf("    Reason for stop: %s\n",cpu->abend);
+		cpuPrintf(cpu,"    Reason for stop: %s\n",cpu->abend);
 	}
+	printPerf(cpu);
+	printUninitReads(cpu);
 }
 
-void reportStage(cpu cpu,enum stage_enum s,const char* fmt,...) {
-	char msgBuf[1024]={0};
+void printPerf(cpu cpu) {
+	static const char *fuName[5]={"alu","mul","ldr","str","brz"};
+	struct perf_struct *p=&cpu->perf;
+	int retired=cpu->instr_retired;
+	int cycles=0;
+	for(int c=0;c<NUMCPI;c++) cycles+=p->cpi[c];
+	if (cycles==0) return;
+	cpuPrintf(cpu,"    CPI stack (each cycle charged to what happened at issue):\n");
+	for(int c=0;c<NUMCPI;c++) {
+		if (p->cpi[c]==0 && c!=cpi_issue) continue;
+		cpuPrintf(cpu,"      %-15s %8d cycles",cpiName[c],p->cpi[c]);
+		if (retired>0) cpuPrintf(cpu,"  CPI %6.3f",((float)p->cpi[c])/retired);
+		cpuPrintf(cpu,"\n");
+	}
+	cpuPrintf(cpu,"    Stall cycles by stage:");
+	int any=0;
+	for(int s=0;s<18;s++) {
+		if (p->stageStall[s]==0) continue;
+		cpuPrintf(cpu," %s=%d",stageName[s],p->stageStall[s]);
+		any=1;
+	}
+	cpuPrintf(cpu,"%s\n",any?"":" none");
+	for(int w=0;w<2;w++) {
+		int *regStall=w?p->wawStall:p->rawStall;
+		any=0;
+		for(int r=0;r<16;r++) {
+			if (regStall[r]==0) continue;
+			if (!any) cpuPrintf(cpu,"    %s stall cycles by register:",w?"WAW":"RAW");
+			cpuPrintf(cpu," R%d=%d",r,regStall[r]);
+			any=1;
+		}
+		if (any) cpuPrintf(cpu,"\n");
+	}
+	cpuPrintf(cpu,"    Writeback conflicts: %d\n",p->wbConflict);
+	cpuPrintf(cpu,"    FU utilization:");
+	for(int fu=alu;fu<=brz;fu++) {
+		cpuPrintf(cpu," %s %.1f%% (%d issued)",fuName[fu],100.0*p->fuBusy[fu]/cycles,p->fuIssued[fu]);
+	}
+	cpuPrintf(cpu,"\n");
+	cpuPrintf(cpu,"    Taken branches: %d, causing %d bubble cycles\n",p->branchTaken,p->cpi[cpi_branch]);
+}
+
+void resetHostStats(cpu cpu) {
+	struct timespec now;
+	memset(&cpu->host,0,sizeof(cpu->host));
+	timespec_get(&now,TIME_UTC);
+	cpu->host.startNs=now.tv_sec*1000000000ll+now.tv_nsec;
+	cpu->host.startTicks=0;
+	cpu->host.startT=cpu->t;
+#ifdef APEX_HOSTSTATS
+	cpu->host.startTicks=hostTicks();
+#endif
+}
+
+void printHostStats(cpu cpu) {
+	// Nanoseconds of simulator time per simulated cycle, by section of cycleCPU
+#ifndef APEX_HOSTSTATS
+	cpuPrintf(cpu,"Host instrumentation is not compiled in... rebuild with make clean; make HOSTSTATS=1\n");
+#else
+	struct hostStats_struct *h=&cpu->host;
+	struct timespec now;
+	uint64_t ticks=hostTicks();
+	timespec_get(&now,TIME_UTC);
+	double nsPerTick=(now.tv_sec*1000000000ll+now.tv_nsec-h->startNs)/(double)(ticks-h->startTicks);
+	int cycles=cpu->t-h->startT;
+	cpuPrintf(cpu,"Host time over %d cycles (%.3f ns per tick):\n",cycles,nsPerTick);
+	if (cycles<=0) return;
+	cpuPrintf(cpu,"    %-16s %10s %12s %10s\n","section","ns/cycle","calls","ns/call");
+	for(int s=0;s<NUMHOST;s++) {
+		char nameBuf[32];
+		if (h->calls[s]==0) continue;
+		if (s==host_cycle) strcpy(nameBuf,"cycleCPU");
+		else if (s==host_advance) strcpy(nameBuf,"advance");
+		else if (s==host_fetch) strcpy(nameBuf,"cycle_fetch");
+		else if (s==host_decode) strcpy(nameBuf,"cycle_decode");
+		else if (s==host_perf) strcpy(nameBuf,"perf counters");
+		else if (s==host_report) strcpy(nameBuf,"reportStage");
+		else if (s==host_print) strcpy(nameBuf,"printing");
+		else sprintf(nameBuf,"%s",s==host_stage+decode?"rf":stageName[s-host_stage]);
+		double ns=h->ticks[s]*nsPerTick;
+		cpuPrintf(cpu,"    %-16s %10.1f %12llu %10.1f\n",nameBuf,ns/cycles,(unsigned long long)h->calls[s],ns/h->calls[s]);
+	}
+	cpuPrintf(cpu,"    Sections nest: reportStage is also counted in the stage that called it, and\n");
+	cpuPrintf(cpu,"    the pipeline diagram part of printing is also counted in cycleCPU\n");
+#endif
+}
+
+void reportStage(cpu cpu,enum stage_enum s,enum event_enum kind,int reg,int value,int value2) {
+	HOST_BEGIN(ts);
+	struct stageEvents_struct *evs=&cpu->events[s];
+	if (evs->n<MAXEVENTS) {
+		struct stageEvent_struct *ev=&evs->ev[evs->n++];
+		ev->kind=kind;
+		ev->reg=reg;
+		ev->value=value;
+		ev->value2=value2;
+	}
+	HOST_END(cpu,host_report,ts);
+}
+
+char * renderEvents(cpu cpu,enum stage_enum s,char *buf,int len) {
+	// Format the events for stage s in the current cycle into buf
+	buf[0]='\0';
+	int pos=0;
+	for(int e=0;e<cpu->events[s].n && pos<len;e++) {
+		struct stageEvent_struct *ev=&cpu->events[s].ev[e];
+		char *p=buf+pos;
+		int left=len-pos;
+		switch(ev->kind) {
+			case ev_idle: snprintf(p,left,"---"); break;
+			case ev_ifetch: snprintf(p,left,"ifetch I%d",(ev->value-0x4000)/4); break;
+			case ev_fetchHalted: snprintf(p,left," --- fetch halted"); break;
+			case ev_decode:
+				switch(ev->value) {
+					case fmt_nop: snprintf(p,left,"decode(nop)"); break;
+					case fmt_dss: snprintf(p,left,"decode(dss)"); break;
+					case fmt_dsi: snprintf(p,left,"decode(dsi) op2=%d",ev->value2); break;
+					case fmt_di: snprintf(p,left,"decode(di) op1=%d",ev->value2); break;
+					case fmt_ssi: snprintf(p,left,"decode(ssi) imm=%d",ev->value2); break;
+					case fmt_ss: snprintf(p,left,"decode(ss)"); break;
+					case fmt_off: snprintf(p,left,"decode(off)"); break;
+				}
+				break;
+			case ev_squashedByBranch: snprintf(p,left," squashed by previous branch"); break;
+			case ev_branchTaken: snprintf(p,left," branch taken"); break;
+			case ev_branchNotTaken: snprintf(p,left," branch not taken"); break;
+			case ev_add: snprintf(p,left,"res=%d+%d",ev->value,ev->value2); break;
+			case ev_sub: snprintf(p,left,"res=%d-%d",ev->value,ev->value2); break;
+			case ev_mul: snprintf(p,left,"res=%d*%d",ev->value,ev->value2); break;
+			case ev_and: snprintf(p,left,"res=%d&%d",ev->value,ev->value2); break;
+			case ev_or: snprintf(p,left,"res=%d|%d",ev->value,ev->value2); break;
+			case ev_xor: snprintf(p,left,"res=%d^%d",ev->value,ev->value2); break;
+			case ev_cmp: snprintf(p,left,"cc based on %d-%d",ev->value,ev->value2); break;
+			case ev_movc: snprintf(p,left,"res=%d",ev->value); break;
+			case ev_effAddr: snprintf(p,left,"effAddr=%08x",ev->value); break;
+			case ev_store: snprintf(p,left,"MEM[%06x]=%d",ev->value,ev->value2); break;
+			case ev_load: snprintf(p,left,"res=MEM[%06x]",ev->value); break;
+			case ev_newPC: snprintf(p,left,"pc=%06x",ev->value); break;
+			case ev_noBranch: snprintf(p,left,"No action... branch not taken"); break;
+			case ev_regWrite: snprintf(p,left,"R%02d<-%d",ev->reg,ev->value); break;
+			case ev_cpuStopped: snprintf(p,left,"cpu stopped"); break;
+			case ev_regRead: snprintf(p,left," R%d=%d",ev->reg,ev->value); break;
+			case ev_regFwdEX: snprintf(p,left," R%d=%d fwd from EX",ev->reg,ev->value); break;
+			case ev_regFwdMEM: snprintf(p,left," R%d=%d fwd from MEM",ev->reg,ev->value); break;
+			case ev_regInvalid: snprintf(p,left," R%d invalid",ev->reg); break;
+			case ev_regInvalidate: snprintf(p,left," invalidate R%d",ev->reg); break;
+		}
+		pos+=strlen(p);
+	}
+	return buf;
+}
+
+void cpuPrintf(cpu cpu,const char *fmt,...) {
+	// All simulator output goes through here... to stdout, or to cpu->output if it is set
 	va_list args;
 	va_start(args,fmt);
-	vsprintf(msgBuf,fmt,args);
-	va_end(args);
-	// Truncate msgBuf to fit
-	if (strlen(msgBuf)+strlen(cpu->stage[s].report) >=128) {
-		msgBuf[127-strlen(cpu->stage[s].report)]='\0';
+	if (cpu->output==NULL) {
+		vprintf(fmt,args);
+		va_end(args);
+		return;
+	}
+	char buf[256];
+	va_list again;
+	va_copy(again,args);
+	int len=vsnprintf(buf,sizeof(buf),fmt,args);
+	if (len<(int)sizeof(buf)) cpu->output(cpu->outputCtx,buf);
+	else {
+		char *big=malloc(len+1);
+		vsnprintf(big,len+1,fmt,again);
+		cpu->output(cpu->outputCtx,big);
+		free(big);
 	}
-	strcat(cpu->stage[s].report,msgBuf);
+	va_end(again);
+	va_end(args);
+}
+
+void cpuError(cpu cpu,const char *msg) {
+	// Like perror, but through cpuPrintf so the library never writes to stdio itself
+	cpuPrintf(cpu,"%s: %s\n",msg,strerror(errno));
 }
 
 /*---------------------------------------------------------
    Internal Function definitions
 ---------------------------------------------------------*/
+int loadBinary(cpu cpu,char * objFileName,const void * obj,size_t size) {
+	// Copies the code and data sections of a mapped binary object into the CPU
+	//    Returns the number of instructions, or -1 if the object is not valid
+	const struct apexObjHeader_struct *hdr=obj;
+	if (hdr->version!=APEXOBJ_VERSION) {
+		cpuPrintf(cpu,"Load aborted, %s is object version %u, expected %d\n",objFileName,hdr->version,APEXOBJ_VERSION);
+		return -1;
+	}
+	size_t need=sizeof(*hdr)+4*((size_t)hdr->codeWords+hdr->dataWords)
+		+hdr->numLines*sizeof(struct apexObjLine_struct)
+		+hdr->numSymbols*sizeof(struct apexObjSymbol_struct)+hdr->strBytes;
+	if (need>size) {
+		cpuPrintf(cpu,"Load aborted, %s is truncated\n",objFileName);
+		return -1;
+	}
+	if (hdr->codeAddr!=0x4000 || hdr->codeWords>MAXINSTRUCTIONS) {
+		cpuPrintf(cpu,"Load aborted, code section of %s does not fit at 0x4000\n",objFileName);
+		return -1;
+	}
+	if (hdr->dataAddr%4 || hdr->dataAddr+4*(size_t)hdr->dataWords>cpu->memSize) {
+		cpuPrintf(cpu,"Load aborted, data section of %s does not fit in %u bytes of memory\n",objFileName,cpu->memSize);
+		return -1;
+	}
+	const uint32_t *code=(const uint32_t *)(hdr+1);
+	for(int i=0;i<hdr->codeWords;i++) storeCode(cpu,i,code[i]);
+	const uint32_t *data=code+hdr->codeWords;
+	for(int i=0;i<hdr->dataWords;i++) dstore(cpu,hdr->dataAddr+4*i,data[i]);
+	const struct apexObjLine_struct *line=(const struct apexObjLine_struct *)(data+hdr->dataWords);
+	const char *str=(const char *)((const struct apexObjSymbol_struct *)(line+hdr->numLines)+hdr->numSymbols);
+	char srcBuf[160];
+	for(int i=0;i<hdr->numLines;i++) {
+		if (line[i].inum>=hdr->codeWords || line[i].text>=hdr->strBytes) continue;
+		snprintf(srcBuf,sizeof(srcBuf),"%u: %.*s",line[i].srcLine,(int)(hdr->strBytes-line[i].text),str+line[i].text);
+		setSource(cpu,line[i].inum,srcBuf);
+	}
+	return hdr->codeWords;
+}
+
+int loadText(cpu cpu,char * objFileName) {
+	// Parses a text object, one hex instruction per line with optional ';' comments
+	//    Returns the number of instructions, or -1 if the load failed
+	char cmtBuf[128];
+	FILE * objF=fopen(objFileName,"r");
+	if (objF==NULL) {
+		cpuError(cpu,"Error - unable to open object file for read");
+		cpuPrintf(cpu,"...Trying to read from object file %s\n",objFileName);
+		return -1;
+	}
+
+	int nread=0;
+	while(!feof(objF)) {
+		int newInst;
+		if (1==fscanf(objF," %08x",&newInst)) {
+			if (nread>=MAXINSTRUCTIONS) {
+				cpuPrintf(cpu,"Load aborted, too many instructions in %s\n",objFileName);
+				fclose(objF);
+				return -1;
+			}
+			storeCode(cpu,nread++,newInst);
+		} else if (1==fscanf(objF,"; %127[^\n]\n",cmtBuf)) {
+			// apexAsm comments are "<inum> : <source line>", keep the source for the profile
+			char *src=cmtBuf;
+			int skip=0;
+			sscanf(cmtBuf,"%*d : %n",&skip);
+			src+=skip;
+			if (nread>0) setSource(cpu,nread-1,src);
+		} else {
+			fscanf(objF," %127s ",cmtBuf);
+			cpuPrintf(cpu,"Load aborted, unrecognized object code: %s\n",cmtBuf);
+			fclose(objF);
+			return -1;
+		}
+	}
+	fclose(objF);
+	return nread;
+}
+
+int finishLoad(cpu cpu,int nread) {
+	// Common end of loadCPU and loadBuffer... nread is from loadBinary or loadText
+	if (nread<0) return -1;
+	cpu->numInstructions=nread;
+	cpu->pc=0x4000;
+	cpu->halt_fetch=cpu->stop=cpu->halted=0;
+	if (cpu->profile) startProfile(cpu); // counters for the new program
+	if (cpu->trace) cpuPrintf(cpu,"Loaded %d instructions starting at adress 0x4000\n",nread);
+	return nread;
+}
+
 
 void cycle_fetch(cpu cpu) {
 	// Don't run if anything downstream is stalled
-	for(int s=1;s<18;s++) if (cpu->stage[s].status==stage_stalled) return;
-	if (cpu->halt_fetch) {
-		cpu->stage[fetch].status=stage_squashed;
-		cpu->stage[fetch].instruction=0;
-		cpu->stage[fetch].opcode=0;
+	if (cpu->stallMask & ~1u) return;
+	if (cpu->halt_fetch || cpu->drain) {
+		setStatus(cpu,fetch,stage_squashed);
+		cpu->stage[fetch]->bubble=cpu->drain?cpi_drain:cpu->perf.fetchBubble;
+		cpu->stage[fetch]->bubblePc=cpu->drain?-1:cpu->perf.fetchBubblePc;
+		cpu->stage[fetch]->instruction=0;
+		cpu->stage[fetch]->opcode=0;
 		return;
 	}
-	int inst=ifetch(cpu);
+	const struct apexPredecode_struct *pd=ifetchDecoded(cpu);
 	if (!cpu->stop) {
-		cpu->stage[fetch].status=stage_noAction;
-		cpu->stage[fetch].instruction=inst;
-		cpu->stage[fetch].opcode=(inst>>24);
-		if (cpu->stage[fetch].opcode<0 || cpu->stage[fetch].opcode>HALT) {
+		setStatus(cpu,fetch,stage_noAction);
+		cpu->stage[fetch]->pd=pd;
+		cpu->stage[fetch]->instruction=pd->instruction;
+		cpu->stage[fetch]->opcode=pd->opcode;
+		if (pd->opcode<0 || pd->opcode>HALT) {
 			cpu->stop=1;
 			sprintf(cpu->abend,"Invalid opcode %x after ifetch(%08x)",
-				cpu->stage[fetch].opcode,cpu->pc);
+				pd->opcode,cpu->pc);
 			return;
 		}
-		reportStage(cpu,fetch,"ifetch %s",getInum(cpu,cpu->pc));
-		if (cpu->stage[fetch].opcode==HALT) {
+		reportStage(cpu,fetch,ev_ifetch,0,cpu->pc,0);
+		if (cpu->stage[fetch]->opcode==HALT) {
 			cpu->halt_fetch=1; // Stop fetching when the HALT instruction is fetched
-			reportStage(cpu,fetch," --- fetch halted");
+			cpu->perf.fetchBubble=cpi_halt;
+			cpu->perf.fetchBubblePc=cpu->pc;
+			reportStage(cpu,fetch,ev_fetchHalted,0,0,0);
 		}
-		cpu->stage[fetch].pc=cpu->pc;
-		cpu->stage[fetch].status=stage_actionComplete;
+		cpu->stage[fetch]->pc=cpu->pc;
+		setStatus(cpu,fetch,stage_actionComplete);
 		cpu->pc+=4;
 	}
 }
 
 void cycle_decode(cpu cpu) {
 	// Does the first half (the decode part) of the decode/fetch regs stage
-	if (cpu->stage[decode].status==stage_squashed) return;
-	if (cpu->stage[decode].status==stage_stalled) return; // Decode already done
-	enum opFormat_enum fmt=opInfo[cpu->stage[decode].opcode].format;
-	int inst=cpu->stage[decode].instruction;
-	switch(fmt) {
+	if (cpu->stage[decode]->status==stage_squashed) return;
+	if (cpu->stage[decode]->status==stage_stalled) return; // Decode already done
+	const struct apexPredecode_struct *pd=cpu->stage[decode]->pd;
+	cpu->stage[decode]->dr=pd->dr;
+	cpu->stage[decode]->sr1=pd->sr1;
+	cpu->stage[decode]->sr2=pd->sr2;
+	cpu->stage[decode]->imm=pd->imm;
+	cpu->stage[decode]->offset=pd->offset;
+	cpu->stage[decode]->func=pd->func;
+	cpu->stage[decode]->ccZ=cpu->stage[decode]->ccP=-1;
+	switch(pd->format) {
 		case fmt_nop:
-			reportStage(cpu,decode,"decode(nop)");
-			break; // No decoding required
 		case fmt_dss:
-			cpu->stage[decode].dr=(inst&0x00f00000)>>20;
-			cpu->stage[decode].sr1=(inst&0x000f0000)>>16;
-			cpu->stage[decode].sr2=(inst&0x0000f000)>>12;
-			reportStage(cpu,decode,"decode(dss)");
+		case fmt_ss:
+		case fmt_off:
+			reportStage(cpu,decode,ev_decode,0,pd->format,0);
 			break;
 		case fmt_dsi:
-			cpu->stage[decode].dr=(inst&0x00f00000)>>20;
-			cpu->stage[decode].sr1=(inst&0x000f0000)>>16;
-			cpu->stage[decode].imm=((inst&0x0000ffff)<<16)>>16;
-			cpu->stage[decode].op2=cpu->stage[decode].imm;
-			reportStage(cpu,decode,"decode(dsi) op2=%d",cpu->stage[decode].op2);
+			cpu->stage[decode]->op2=pd->imm;
+			reportStage(cpu,decode,ev_decode,0,pd->format,cpu->stage[decode]->op2);
 			break;
 		case fmt_di:
-			cpu->stage[decode].dr=(inst&0x00f00000)>>20;
-			cpu->stage[decode].imm=((inst&0x0000ffff)<<16)>>16; // Shift left/right to propagate sign bit
-			cpu->stage[decode].op1=cpu->stage[decode].imm;
-			reportStage(cpu,decode,"decode(di) op1=%d",cpu->stage[decode].op1);
+			cpu->stage[decode]->op1=pd->imm;
+			reportStage(cpu,decode,ev_decode,0,pd->format,cpu->stage[decode]->op1);
 			break;
 		case fmt_ssi:
-			cpu->stage[decode].sr2=(inst&0x00f00000)>>20;
-			cpu->stage[decode].sr1=(inst&0x000f0000)>>16;
-			cpu->stage[decode].imm=((inst&0x0000ffff)<<16)>>16;
-			reportStage(cpu,decode,"decode(ssi) imm=%d",cpu->stage[decode].imm);
-			break;
-		case fmt_ss:
-			cpu->stage[decode].sr1=(inst&0x000f0000)>>16;
-			cpu->stage[decode].sr2=(inst&0x0000f000)>>12;
-			reportStage(cpu,decode,"decode(ss)");
-			break;
-		case fmt_off:
-			cpu->stage[decode].offset=((inst&0x0000ffff)<<16)>>16;
-			reportStage(cpu,decode,"decode(off)");
+			reportStage(cpu,decode,ev_decode,0,pd->format,cpu->stage[decode]->imm);
 			break;
 		default :
 			cpu->stop=1;
-			sprintf(cpu->abend,"Decode format %d not recognized in cycle_decode",fmt);
+			sprintf(cpu->abend,"Decode format %d not recognized in cycle_decode",pd->format);
 	}
 }
 
 void cycle_stage(cpu cpu,int stage) {
-	for(int s=stage+1;s<18;s++) if (cpu->stage[s].status==stage_stalled) return;
-	if (cpu->stage[stage].status==stage_squashed) return;
+	if (cpu->stallMask>>(stage+1)) return; // Something downstream is stalled
+	if (!(cpu->busyMask & (1u<<stage))) return; // squashed
 	assert(stage>=0 && stage<=writeback);
-	assert(cpu->stage[stage].opcode>=0 && cpu->stage[stage].opcode<=HALT);
-	opStageFn stageFn=opFns[stage][cpu->stage[stage].opcode];
+	assert(cpu->stage[stage]->opcode>=0 && cpu->stage[stage]->opcode<=HALT);
+	opStageFn stageFn=cpu->stage[stage]->pd->fns[stageFnSlot[stage]];
 	if (stageFn) {
 		stageFn(cpu);
-		if (cpu->stage[stage].status==stage_noAction)
-			cpu->stage[stage].status=stage_actionComplete;
+		if (cpu->stage[stage]->status==stage_noAction)
+			setStatus(cpu,stage,stage_actionComplete);
 	} else {
-		cpu->stage[stage].status=stage_noAction;
+		setStatus(cpu,stage,stage_noAction);
 	}
-	if (stage==writeback && cpu->stage[writeback].status!=stage_squashed) {
+	if (stage==writeback && cpu->stage[writeback]->status!=stage_squashed) {
 		cpu->instr_retired++;
 	}
 }
 
-char * getInum(cpu cpu,int pc) {
-	static char inumBuf[5];
+void swapStage(cpu cpu,int s1,int s2) {
+	struct apexStage_struct *tmp=cpu->stage[s1];
+	cpu->stage[s1]=cpu->stage[s2];
+	cpu->stage[s2]=tmp;
+	// The stall and busy bits move with the latches
+	unsigned int b1=1u<<s1,b2=1u<<s2;
+	unsigned int diff=((cpu->stallMask&b1)!=0) != ((cpu->stallMask&b2)!=0);
+	if (diff) cpu->stallMask^=(b1|b2);
+	diff=((cpu->busyMask&b1)!=0) != ((cpu->busyMask&b2)!=0);
+	if (diff) cpu->busyMask^=(b1|b2);
+}
+
+char * getInum(cpu cpu,int pc,char *inumBuf) {
+	// inumBuf must hold at least 12 characters
 	inumBuf[0]=0x00;
 	if (pc==-1) return inumBuf;
 	int n=(pc-0x4000)/4;
@@ -499,10 +774,10 @@ char * getInum(cpu cpu,int pc) {
 
 void reportReg(cpu cpu,int r) {
 	int v=cpu->reg[r];
-	printf("R%02d",r);
+	cpuPrintf(cpu,"R%02d",r);
 	if (cpu->regValid[r]) {
-		if (v!=0xdeadbeef) printf("=%05d ",v);
-	   else printf(" ----- ");
-	} else printf(" xxxxx ");
-	if (7==r%8) printf("\n   ");
+		if (v!=0xdeadbeef) cpuPrintf(cpu,"=%05d ",v);
+	   else cpuPrintf(cpu," ----- ");
+	} else cpuPrintf(cpu," xxxxx ");
+	if (7==r%8) cpuPrintf(cpu,"\n   ");
 }
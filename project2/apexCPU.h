@@ -1,6 +1,7 @@
 #ifndef APEXCPU_H // Guard against recursive includes
 #define APEXCPU_H
-#include <stdarg.h> // To enable reportStage
+#include <stddef.h>
+#include "apexHost.h"
 
 enum fu_enum {
 	alu,
@@ -17,27 +18,99 @@ enum stageStatus_enum {
 	stage_actionComplete
 };
 
-struct apexStage_struct {
-	int pc;
+typedef struct apexCPU_struct * cpu;
+typedef void (*opStageFn)(cpu cpu); // Needed in apexOpcodes.h
+typedef void (*apexOutputFn)(void *ctx,const char *text); // See cpuPrintf
+
+/*---------------------------------------------------------
+  Predecoded instruction - built once per code word by
+  loadCPU so fetch and decode only need to copy fields
+---------------------------------------------------------*/
+struct apexPredecode_struct {
 	int instruction;
 	int opcode;
-	char mnemonic[8];
+	int format; // enum opFormat_enum
 	int dr;
 	int sr1;
 	int sr2;
+	int imm; // sign extended
+	int offset; // sign extended
+	enum fu_enum func;
+	opStageFn fns[5]; // decode, FU stage 1-3 and writeback functions
+};
+
+/*---------------------------------------------------------
+  Stage events - recorded by each stage as it does its work,
+  and only formatted into text when printState needs them
+---------------------------------------------------------*/
+enum event_enum {
+	ev_idle, // ---
+	ev_ifetch, // value=pc
+	ev_fetchHalted,
+	ev_decode, // value=format, value2=op2/op1/imm shown for that format
+	ev_squashedByBranch,
+	ev_branchTaken,
+	ev_branchNotTaken,
+	ev_add, // value=op1, value2=op2
+	ev_sub,
+	ev_mul,
+	ev_and,
+	ev_or,
+	ev_xor,
+	ev_cmp,
+	ev_movc, // value=result
+	ev_effAddr, // value=address
+	ev_store, // value=address, value2=value stored
+	ev_load, // value=address
+	ev_newPC, // value=pc
+	ev_noBranch,
+	ev_regWrite, // reg, value
+	ev_cpuStopped,
+	ev_regRead, // reg, value
+	ev_regFwdEX, // reg, value
+	ev_regFwdMEM, // reg, value
+	ev_regInvalid, // reg
+	ev_regInvalidate // reg
+};
+
+struct stageEvent_struct {
+	short kind; // enum event_enum
+	short reg;
+	int value;
+	int value2;
+};
+
+#define MAXEVENTS 6 // per stage per cycle... extra events are dropped
+struct stageEvents_struct {
+	int n;
+	struct stageEvent_struct ev[MAXEVENTS];
+};
+
+/*---------------------------------------------------------
+  Stage latch - only what the datapath needs. Text for the
+  pipeline reports lives in the events table of the cpu.
+---------------------------------------------------------*/
+struct apexStage_struct {
+	const struct apexPredecode_struct *pd;
+	int pc;
+	int instruction;
 	int imm;
 	int offset;
 	int op1;
 	int op2;
 	int result;
 	int effectiveAddr;
-	int squashed;
-	int stalled;
-	char report[128];
-	enum stageStatus_enum status;
-	int branch_taken;
-	enum fu_enum func;
-	int pipearr[5];
+	short opcode;
+	signed char dr;
+	signed char sr1;
+	signed char sr2;
+	unsigned char status; // enum stageStatus_enum
+	unsigned char branch_taken;
+	unsigned char func; // enum fu_enum
+	unsigned char bubble; // enum cpi_enum, why the stage is empty
+	signed char ccZ; // condition codes this instruction set in execute,
+	signed char ccP; //    -1 if it has not set them
+	int bubblePc; // pc of the instruction that caused the bubble, or -1
 };
 
 struct CC_struct {
@@ -51,26 +124,150 @@ struct fwdBus_struct {
 	int value;
 };
 
+/*---------------------------------------------------------
+  Paged memory - code and data memory are sparse, two level
+  page tables of 4K byte pages. Pages are allocated on the
+  first store, so untouched memory costs nothing. Each
+  memory has a one entry page cache (tlb) in the hot state.
+  Data pages keep a bit per word that is set when the word
+  is written, and reads of unwritten words are counted per
+  address in a hash table. Breakpoints and watchpoints are
+  bits per word in the code and data pages.
+---------------------------------------------------------*/
+#define PAGEBITS 12 // 4K byte pages
+#define PAGEWORDS (1<<(PAGEBITS-2))
+#define DIRBITS 10 // page number bits resolved by each level
+#define DIRSIZE (1<<DIRBITS)
+#define DEFAULT_MEMSIZE 0x01000000 // 16M bytes of data memory
+#define MAXINSTRUCTIONS 0x1ffff000 // code from 0x4000 up to the largest positive pc
+
+struct dataPage_struct {
+	int word[PAGEWORDS];
+	unsigned int written[PAGEWORDS/32]; // bit per word
+	unsigned int watched[PAGEWORDS/32];
+};
+
+struct codePage_struct {
+	struct apexPredecode_struct pd[PAGEWORDS];
+	unsigned int breakpt[PAGEWORDS/32]; // bit per instruction
+};
+
+struct tlb_struct {
+	unsigned int vpn; // page number cached, or ~0 if none
+	void *page;
+};
+
+struct pageTable_struct {
+	int pages; // number of pages allocated
+	void **dir[DIRSIZE]; // second level tables, allocated on first use
+};
+
+struct storeDelta_struct {
+	int addr;
+	int old; // value before the store
+	int written; // 1 if the word had been written before the store
+};
+
+struct storeLog_struct {
+	// Ring buffer of stores, so data memory can be rolled back
+	struct storeDelta_struct *d;
+	size_t cap; // entries in d
+	size_t head; // stores logged so far... the newest is d[(head-1)%cap]
+	size_t tail; // oldest store still in d
+};
+
+struct uninitRead_struct {
+	int addr;
+	int count; // 0 if the hash table slot is empty
+	int firstCycle;
+};
+
+struct uninitReads_struct {
+	int total; // reads of unwritten words
+	int n; // distinct addresses
+	int size; // slots in tbl, a power of 2
+	struct uninitRead_struct *tbl;
+};
+
+/*---------------------------------------------------------
+  Performance counters - plain increments in cycleCPU and
+  the decode helpers, reported by printPerf. Each cycle is
+  charged to one cpi_enum, by what happened at issue (the
+  decode stage moving an instruction to its FU).
+---------------------------------------------------------*/
+enum cpi_enum {
+	cpi_empty, // nothing fetched yet
+	cpi_issue,
+	cpi_raw, // decode stalled for a source register
+	cpi_waw, // decode stalled for its destination register
+	cpi_branch, // bubbles behind a taken branch
+	cpi_halt, // bubbles behind HALT
+	cpi_drain, // bubbles while draining for the functional engine
+	NUMCPI
+};
+
+struct perf_struct {
+	int cpi[NUMCPI]; // cycles charged to each cpi_enum
+	int stageStall[18]; // cycles each stage was stalled
+	int rawStall[16]; // decode stall cycles waiting on each source register
+	int wawStall[16]; // decode stall cycles waiting on each destination register
+	int wbConflict; // cycles more than one FU finished
+	int fuBusy[5]; // cycles with an instruction in any stage of the FU
+	int fuIssued[5];
+	int branchTaken;
+	int decodeStall; // cpi_raw or cpi_waw, for the current decode stall
+	int decodeStallReg; // the register that decode stall is charged to
+	int fetchBubble; // cpi_branch or cpi_halt, while fetch is halted
+	int fetchBubblePc; // pc of the branch or HALT that halted fetch
+};
+
+struct pcProfile_struct {
+	int cycles[NUMCPI]; // cycles charged to one instruction, by cpi_enum
+};
+
 struct apexCPU_struct {
+	// Hot state, used every cycle
+	struct apexStage_struct *stage[18]; // Latch in each stage... rotated to advance
+	unsigned int stallMask; // bit s set if stage s is stalled
+	unsigned int busyMask; // bit s set if stage s is not squashed
 	int pc;
-	int reg[16];
-	int regValid[16];
-	struct CC_struct cc;
-	struct apexStage_struct stage[18];
-	int codeMem[128]; // addresses 0x4000 - 0x4200
-	int dataMem[128]; // addresses 0x0000 - 0x0200
-	int lowMem;
-	int highMem;
 	int t;
-	int numInstructions;
 	int instr_retired;
+	int func_retired; // instructions executed by the functional engine
 	int halt_fetch;
+	int drain; // stop fetching so the pipeline empties
 	int stop;
-	char abend[64];
-	struct fwdBus_struct ex_fwdBus,mem_fwdBus;
+	int halted; // set when stop is because HALT retired
+	int trace; // print the pipeline diagram row each cycle
 	int pipearr[5];
+	struct tlb_struct itlb,dtlb;
+	struct fwdBus_struct ex_fwdBus,mem_fwdBus;
+	struct CC_struct cc;
+	int reg[16];
+	int regValid[16];
+	struct apexStage_struct latch[18]; // Storage for the stage latches
+	struct perf_struct perf;
+	// Cold state
+	const struct opTable_struct *ops; // Dispatch table used to predecode
+	int numInstructions;
+	unsigned int memSize; // data addresses must be below memSize
+	char abend[64];
+	struct stageEvents_struct events[18]; // Events for each stage in the current cycle
+	// Fields above are saved directly in snapshots, fields below are saved by walking them
+	struct pageTable_struct codePages; // indexed by instruction number, from 0x4000
+	struct pageTable_struct dataPages; // indexed by address, from 0x0000
+	struct uninitReads_struct uninit;
+	int watchHit; // set when a watched word is stored
+	int watchAddr;
+	struct storeLog_struct *storeLog; // NULL unless keeping history
+	struct pcProfile_struct *profile; // NULL unless profiling, see apexProf.h
+	int profileSize; // entries in profile, the last is for cycles with no instruction
+	char **srcText; // assembler source of each instruction, from the object file
+	int srcSize; // entries in srcText
+	struct hostStats_struct host; // simulator time per section, see apexHost.h
+	apexOutputFn output; // receives all printed text, stdout if NULL
+	void *outputCtx; // passed to output
 };
-typedef struct apexCPU_struct * cpu;
 
 enum stage_enum {
 	fetch,
@@ -94,16 +291,37 @@ enum stage_enum {
 };
 
 extern char *stageName[18]; // defined/initialized in apexCPU.c
-typedef void (*opStageFn)(cpu cpu); // Needed in apexOpcodes.h
+extern const char *cpiName[NUMCPI]; // defined/initialized in apexCPU.c
+
+/*---------------------------------------------------------
+  setStatus - all stage status changes go through here to
+  keep the stall and busy masks of the cpu up to date
+---------------------------------------------------------*/
+static inline void setStatus(cpu cpu,int s,enum stageStatus_enum status) {
+	unsigned int bit=1u<<s;
+	cpu->stage[s]->status=status;
+	if (status==stage_stalled) cpu->stallMask|=bit;
+	else cpu->stallMask&=~bit;
+	if (status==stage_squashed) cpu->busyMask&=~bit;
+	else cpu->busyMask|=bit;
+}
 
 #include "apexOpcodes.h"
 
 
 void initCPU(cpu cpu);
-void loadCPU(cpu cpu,char * objFileName);
+int loadCPU(cpu cpu,char * objFileName);
+int loadBuffer(cpu cpu,char * name,const void * obj,size_t size);
+int loadData(cpu cpu,char * dataFileName);
 void printState(cpu cpu);
 void cycleCPU(cpu cpu);
 void printStats(cpu cpu);
-void reportStage(cpu cpu,enum stage_enum s,const char* fmt,...);
+void printPerf(cpu cpu);
+void resetHostStats(cpu cpu);
+void printHostStats(cpu cpu);
+void reportStage(cpu cpu,enum stage_enum s,enum event_enum kind,int reg,int value,int value2);
+char * renderEvents(cpu cpu,enum stage_enum s,char *buf,int len);
+void cpuPrintf(cpu cpu,const char *fmt,...) __attribute__((format(printf,2,3)));
+void cpuError(cpu cpu,const char *msg);
 
 #endif
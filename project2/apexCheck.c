@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apexCPU.h"
+#include "apexFunc.h"
+#include "apexMem.h"
+#include "apexProf.h"
+
+/*---------------------------------------------------------
+This file contains a differential checker. It runs each
+program on two cpus: the pipeline model (cycleCPU) and the
+functional engine (stepFunctional) as the architectural
+reference, in lockstep.
+
+Each time the pipeline retires an instruction, the
+reference executes one instruction (skipping NOPs, which
+never reach writeback), and the checker compares:
+	- the pc and opcode of the retired instruction
+	- the register written by dest_writeback (the ev_regWrite
+	  event) and its value
+	- the condition codes the instruction produced
+	- the address and value of each STORE (the ev_store
+	  events of str2, which happen before the STORE retires,
+	  so they are queued in program order)
+	- the whole register file, which the pipeline only
+	  writes at writeback, in order
+	- how the program stopped
+The first difference stops the check, with a dump of both
+states. Paired with apexGen, this checks changes to the
+pipeline hot paths against the ISA semantics.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+  Data structures
+---------------------------------------------------------*/
+struct refInst_struct {
+	int pc;
+	int opcode;
+	int dr; // register written, or -1
+	int value; // value written to dr
+	int isStore;
+	int storeAddr;
+	int storeValue;
+};
+
+#define MAXSTORES 16 // STOREs between str2 and writeback
+
+struct storeQueue_struct {
+	int addr[MAXSTORES];
+	int value[MAXSTORES];
+	int head;
+	int tail;
+};
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+int checkProgram(char *objFile,int maxCycles,unsigned int memSize,int quiet);
+int stepReference(cpu ref,struct refInst_struct *ri);
+int compareRetired(cpu pipe,cpu ref,struct refInst_struct *ri,struct storeQueue_struct *sq,char *why,int len);
+void printArch(cpu cpu);
+
+/*---------------------------------------------------------
+  Main function
+---------------------------------------------------------*/
+int main(int argc,char **argv) {
+	int maxCycles=0;
+	unsigned int memSize=DEFAULT_MEMSIZE;
+	int quiet=0;
+	int posArg=1;
+	while (argc>posArg && argv[posArg][0]=='-') {
+		if (0==strcmp(argv[posArg],"-h")) {
+			printf("APEX differential checker\n");
+			printf("Invoke as: %s [-q] [--max-cycles <n>] [--mem-size <bytes>] <objFile>...\n",argv[0]);
+			printf("Runs each object file on the pipeline model and the functional engine in\n");
+			printf("   lockstep, and stops at the first retired instruction where they differ.\n");
+			printf("   -q only reports programs that differ. Exit code is 0 if all agree.\n");
+			return 0;
+		} else if (0==strcmp(argv[posArg],"-q")) {
+			quiet=1;
+		} else if (0==strcmp(argv[posArg],"--max-cycles") && argc>posArg+1) {
+			maxCycles=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--mem-size") && argc>posArg+1) {
+			memSize=strtoul(argv[++posArg],NULL,0)&~3u;
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
+		}
+		posArg++;
+	}
+	if (argc<=posArg) {
+		printf("Error - nothing to check. Use -h for help.\n");
+		return 1;
+	}
+	int failed=0;
+	for(int a=posArg;a<argc;a++) failed+=checkProgram(argv[a],maxCycles,memSize,quiet);
+	if (argc-posArg>1) printf("%d programs checked, %d differ\n",argc-posArg,failed);
+	return failed?1:0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+int checkProgram(char *objFile,int maxCycles,unsigned int memSize,int quiet) {
+	// Returns 0 if the pipeline and the reference agree, 1 if not
+	static struct apexCPU_struct pipe,ref;
+	struct storeQueue_struct sq={{0},{0},0,0};
+	char why[256];
+	why[0]=0x00;
+	initCPU(&pipe);
+	initCPU(&ref);
+	pipe.trace=ref.trace=0;
+	pipe.memSize=ref.memSize=memSize;
+	if (loadCPU(&pipe,objFile)<=0 || loadCPU(&ref,objFile)<=0) {
+		printf("%s: load failed\n",objFile);
+		freeMem(&pipe);
+		freeMem(&ref);
+		return 1;
+	}
+
+	while(!pipe.stop && (maxCycles<=0 || pipe.t<maxCycles)) {
+		int retired=pipe.instr_retired;
+		cycleCPU(&pipe);
+		const struct stageEvents_struct *evs=&pipe.events[str2];
+		for(int e=0;e<evs->n;e++) {
+			if (evs->ev[e].kind!=ev_store) continue;
+			if (sq.tail-sq.head==MAXSTORES) {
+				sprintf(why,"more than %d STOREs in flight",MAXSTORES);
+				break;
+			}
+			sq.addr[sq.tail%MAXSTORES]=evs->ev[e].value;
+			sq.value[sq.tail%MAXSTORES]=evs->ev[e].value2;
+			sq.tail++;
+		}
+		if (why[0]) break;
+		if (pipe.instr_retired!=retired) {
+			struct refInst_struct ri;
+			if (!stepReference(&ref,&ri)) {
+				sprintf(why,"pipeline retired pc=%05x, reference stopped because %s",pipe.stage[writeback]->pc,ref.abend);
+				break;
+			}
+			if (compareRetired(&pipe,&ref,&ri,&sq,why,sizeof(why))) break;
+		}
+	}
+	if (why[0]==0x00 && pipe.halted && sq.head!=sq.tail) {
+		sprintf(why,"HALT retired with MEM[%04x]=%d stored by an instruction that never retired",
+			sq.addr[sq.head%MAXSTORES],sq.value[sq.head%MAXSTORES]);
+	}
+	if (why[0]==0x00 && pipe.stop && !pipe.halted) {
+		// The reference should fail the same way on its next instruction
+		struct refInst_struct ri;
+		if (stepReference(&ref,&ri)) {
+			sprintf(why,"pipeline stopped because %s, reference executed pc=%05x",pipe.abend,ri.pc);
+		} else if (strcmp(pipe.abend,ref.abend)) {
+			sprintf(why,"pipeline stopped because %s, reference because %s",pipe.abend,ref.abend);
+		}
+	}
+
+	int rc=0;
+	if (why[0]) {
+		printf("%s: DIFFERS after %d instructions, cycle %d: %s\n",objFile,ref.func_retired,pipe.t,why);
+		printf("Pipeline state:");
+		printState(&pipe);
+		printf("\nReference state:\n");
+		printArch(&ref);
+		rc=1;
+	} else if (!quiet) {
+		printf("%s: agree on %d instructions, %d cycles, stop=%s\n",objFile,pipe.instr_retired,pipe.t,
+			pipe.stop?pipe.abend:"cycle budget exhausted");
+	}
+	freeProfile(&pipe);
+	freeProfile(&ref);
+	freeMem(&pipe);
+	freeMem(&ref);
+	return rc;
+}
+
+int stepReference(cpu ref,struct refInst_struct *ri) {
+	// Executes the next instruction that the pipeline would retire (NOPs are skipped)
+	//    and describes its effects. Returns 0 if the reference stopped instead
+	const struct apexPredecode_struct *pd;
+	do {
+		if (ref->stop) return 0;
+		pd=ifetchDecoded(ref);
+		if (ref->stop) return 0;
+		ri->pc=ref->pc;
+		ri->opcode=pd->opcode;
+		ri->isStore=(pd->opcode==STORE);
+		if (ri->isStore) {
+			ri->storeAddr=ref->reg[pd->sr1]+pd->imm;
+			ri->storeValue=ref->reg[pd->sr2];
+		}
+		if (!stepFunctional(ref)) return 0;
+	} while(pd->opcode==NOP);
+	ri->dr=-1;
+	if (pd->format==fmt_dss || pd->format==fmt_dsi || pd->format==fmt_di) {
+		ri->dr=pd->dr;
+		ri->value=ref->reg[pd->dr];
+	}
+	return 1;
+}
+
+int compareRetired(cpu pipe,cpu ref,struct refInst_struct *ri,struct storeQueue_struct *sq,char *why,int len) {
+	// Compares the instruction in writeback with the one the reference executed.
+	//    Returns 0 if they agree, or 1 with the difference described in why
+	const struct apexStage_struct *wb=pipe->stage[writeback];
+	char instBuf[32];
+	disassemble(wb->instruction,instBuf);
+	if (wb->pc!=ri->pc || wb->opcode!=ri->opcode) {
+		snprintf(why,len,"pipeline retired %s at pc=%05x, reference executed pc=%05x",instBuf,wb->pc,ri->pc);
+		return 1;
+	}
+	int wrote=0;
+	const struct stageEvents_struct *evs=&pipe->events[writeback];
+	for(int e=0;e<evs->n;e++) {
+		if (evs->ev[e].kind!=ev_regWrite) continue;
+		wrote=1;
+		if (evs->ev[e].reg!=ri->dr || evs->ev[e].value!=ri->value) {
+			snprintf(why,len,"%s at pc=%05x wrote R%d=%d, reference R%d=%d",
+				instBuf,wb->pc,evs->ev[e].reg,evs->ev[e].value,ri->dr,ri->value);
+			return 1;
+		}
+	}
+	if (!wrote && ri->dr>=0) {
+		snprintf(why,len,"%s at pc=%05x wrote no register, reference R%d=%d",instBuf,wb->pc,ri->dr,ri->value);
+		return 1;
+	}
+	if (setsConditionCodes(wb->opcode)) {
+		// The codes set_conditionCodes recorded in the latch, not recomputed from the result
+		if (wb->ccZ<0) {
+			snprintf(why,len,"%s at pc=%05x never set the condition codes, reference cc.z=%d cc.p=%d",
+				instBuf,wb->pc,ref->cc.z,ref->cc.p);
+			return 1;
+		}
+		if (wb->ccZ!=ref->cc.z || wb->ccP!=ref->cc.p) {
+			snprintf(why,len,"%s at pc=%05x set cc.z=%d cc.p=%d, reference cc.z=%d cc.p=%d",
+				instBuf,wb->pc,wb->ccZ,wb->ccP,ref->cc.z,ref->cc.p);
+			return 1;
+		}
+	}
+	if (ri->isStore) {
+		if (sq->head==sq->tail) {
+			snprintf(why,len,"%s at pc=%05x retired without storing, reference MEM[%04x]=%d",
+				instBuf,wb->pc,ri->storeAddr,ri->storeValue);
+			return 1;
+		}
+		int addr=sq->addr[sq->head%MAXSTORES],value=sq->value[sq->head%MAXSTORES];
+		sq->head++;
+		if (addr!=ri->storeAddr || value!=ri->storeValue) {
+			snprintf(why,len,"%s at pc=%05x stored MEM[%04x]=%d, reference MEM[%04x]=%d",
+				instBuf,wb->pc,addr,value,ri->storeAddr,ri->storeValue);
+			return 1;
+		}
+	}
+	for(int r=0;r<16;r++) {
+		if (pipe->reg[r]!=ref->reg[r]) {
+			snprintf(why,len,"after %s at pc=%05x R%d=%d, reference R%d=%d",
+				instBuf,wb->pc,r,pipe->reg[r],r,ref->reg[r]);
+			return 1;
+		}
+	}
+	if (pipe->halted!=ref->halted) {
+		snprintf(why,len,"%s at pc=%05x: pipeline %s, reference %s",instBuf,wb->pc,
+			pipe->halted?"halted":"did not halt",ref->halted?"halted":"did not halt");
+		return 1;
+	}
+	return 0;
+}
+
+void printArch(cpu cpu) {
+	// Architectural state only... the reference has no pipeline
+	printf("  pc=%05x cc.z=%s cc.p=%s, %d instructions executed\n",
+		cpu->pc,cpu->cc.z?"true":"false",cpu->cc.p?"true":"false",cpu->func_retired);
+	printf("  Int Regs:\n   ");
+	for(int r=0;r<16;r++) {
+		printf(" R%02d=%d",r,cpu->reg[r]);
+		if (r%8==7) printf("\n   ");
+	}
+	printf("\n");
+	printWritten(cpu);
+	if (cpu->stop) printf("  Stopped because %s\n",cpu->abend);
+}
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "apexServe.h"
+
+/*---------------------------------------------------------
+This file contains a client for the simulation server
+(apexSim --serve). It sends each object file as a run
+request, optionally many times over one connection, and
+prints the reply the way apexBatch prints a job, plus the
+request rate. It stands in for the tools that talk to the
+server, and shows how little a client needs.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+int connectServer(char *socketPath);
+int sendRequest(int fd,struct serveRequest_struct *req,const void *obj);
+int readReply(int fd,struct serveReply_struct *reply,int32_t **mem);
+void * readObject(char *fileName,size_t *size);
+int readFull(int fd,void *buf,size_t len);
+int writeFull(int fd,const void *buf,size_t len);
+
+/*---------------------------------------------------------
+  Main function
+---------------------------------------------------------*/
+int main(int argc,char **argv) {
+	struct serveRequest_struct req;
+	memset(&req,0,sizeof(req));
+	req.op=serve_run;
+	int repeat=1;
+	int showRegs=0;
+	int posArg=1;
+	if (argc>posArg && 0==strcmp(argv[posArg],"-h")) {
+		printf("APEX simulation server client\n");
+		printf("Invoke as: %s <socket> [-n <repeat>] [-r] [--max-cycles <n>] [--functional]\n",argv[0]);
+		printf("              [--mem <addr> <words>] <objFile>...\n");
+		printf("       or: %s <socket> --stats | --shutdown\n",argv[0]);
+		printf("Sends each object file to the server started by apexSim --serve <socket>,\n");
+		printf("   <repeat> times, and prints the result. -r also prints the registers, and\n");
+		printf("   --mem prints <words> data words from <addr>.\n");
+		return 0;
+	}
+	if (argc<=posArg) {
+		printf("Error - no socket. Use -h for help.\n");
+		return 1;
+	}
+	char *socketPath=argv[posArg++];
+	while (argc>posArg && argv[posArg][0]=='-') {
+		if (0==strcmp(argv[posArg],"-n") && argc>posArg+1) {
+			repeat=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"-r")) {
+			showRegs=1;
+		} else if (0==strcmp(argv[posArg],"--max-cycles") && argc>posArg+1) {
+			req.maxCycles=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--functional")) {
+			req.flags|=serve_functional;
+		} else if (0==strcmp(argv[posArg],"--mem") && argc>posArg+2) {
+			req.memAddr=strtoul(argv[++posArg],NULL,0);
+			req.memWords=strtoul(argv[++posArg],NULL,0);
+		} else if (0==strcmp(argv[posArg],"--stats")) {
+			req.op=serve_stats;
+		} else if (0==strcmp(argv[posArg],"--shutdown")) {
+			req.op=serve_shutdown;
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
+		}
+		posArg++;
+	}
+	int fd=connectServer(socketPath);
+	if (fd<0) return 1;
+
+	struct serveReply_struct reply;
+	int32_t *mem=NULL;
+	if (req.op!=serve_run) {
+		int ok=sendRequest(fd,&req,NULL) && readReply(fd,&reply,&mem);
+		if (ok) printf("%s\n",reply.message);
+		close(fd);
+		return ok?0:1;
+	}
+	if (argc<=posArg) {
+		printf("Error - nothing to run. Use -h for help.\n");
+		return 1;
+	}
+
+	int failed=0;
+	for(int a=posArg;a<argc;a++) {
+		size_t size;
+		void *obj=readObject(argv[a],&size);
+		if (obj==NULL) {
+			failed++;
+			continue;
+		}
+		req.objBytes=size;
+		struct timespec start,end;
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		int ok=1;
+		for(int r=0;r<repeat && ok;r++) {
+			free(mem);
+			mem=NULL;
+			ok=sendRequest(fd,&req,obj) && readReply(fd,&reply,&mem);
+		}
+		clock_gettime(CLOCK_MONOTONIC,&end);
+		free(obj);
+		if (!ok) {
+			printf("Error - connection to the server lost\n");
+			close(fd);
+			return 1;
+		}
+		double secs=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+		if (reply.status!=serve_ok) {
+			printf("%s failed: %s\n",argv[a],reply.message);
+			failed++;
+			continue;
+		}
+		if (!reply.halted) failed++;
+		printf("%s",argv[a]);
+		if (req.flags&serve_functional) printf(" retired=%d",reply.retired); // no cycles to report
+		else printf(" cycles=%d retired=%d IPC=%5.3f",reply.cycles,reply.retired,
+			reply.cycles?((float)reply.retired)/reply.cycles:0.0);
+		printf(" stop=%s%s",reply.stop?reply.message:(req.flags&serve_functional)?"instruction budget exhausted":"cycle budget exhausted",
+			reply.cached?" (cached)":"");
+		if (repeat>1) printf(", %d requests at %.1f us each",repeat,1e6*secs/repeat);
+		printf("\n");
+		if (showRegs) {
+			printf("   ");
+			for(int r=0;r<16;r++) printf(" R%02d=%d%s",r,reply.reg[r],r%8==7?"\n   ":"");
+			printf(" cc.z=%d cc.p=%d\n",reply.ccZ,reply.ccP);
+		}
+		for(uint32_t i=0;i<reply.memWords;i++) printf("    MEM[%04x]=%d\n",req.memAddr+4*i,mem[i]);
+	}
+	free(mem);
+	close(fd);
+	return failed?1:0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+int connectServer(char *socketPath) {
+	// Returns the connected socket, or -1
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",socketPath);
+	int fd=socket(AF_UNIX,SOCK_STREAM,0);
+	if (fd<0 || 0!=connect(fd,(struct sockaddr *)&addr,sizeof(addr))) {
+		perror("Error - unable to connect to the server");
+		if (fd>=0) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int sendRequest(int fd,struct serveRequest_struct *req,const void *obj) {
+	uint32_t len=sizeof(*req)+req->objBytes;
+	if (req->op!=serve_run) len=sizeof(*req);
+	return writeFull(fd,&len,sizeof(len)) && writeFull(fd,req,sizeof(*req))
+		&& (len==sizeof(*req) || writeFull(fd,obj,req->objBytes));
+}
+
+int readReply(int fd,struct serveReply_struct *reply,int32_t **mem) {
+	// Returns 1 if a whole reply was read, with the data words (if any) in a malloc'd *mem
+	uint32_t len;
+	if (!readFull(fd,&len,sizeof(len)) || len<sizeof(*reply)) return 0;
+	if (!readFull(fd,reply,sizeof(*reply))) return 0;
+	if (len!=sizeof(*reply)+reply->memWords*sizeof(int32_t)) return 0;
+	if (reply->memWords==0) return 1;
+	*mem=malloc(reply->memWords*sizeof(int32_t));
+	return readFull(fd,*mem,reply->memWords*sizeof(int32_t));
+}
+
+void * readObject(char *fileName,size_t *size) {
+	// Returns the whole file in a malloc'd buffer, or NULL
+	FILE *f=fopen(fileName,"rb");
+	if (f==NULL) {
+		perror("Error - unable to open object file for read");
+		printf("...Trying to read from object file %s\n",fileName);
+		return NULL;
+	}
+	fseek(f,0,SEEK_END);
+	long n=ftell(f);
+	rewind(f);
+	void *obj=malloc(n>0?n:1);
+	if (n<0 || (size_t)n!=fread(obj,1,n,f)) {
+		printf("Error - unable to read object file %s\n",fileName);
+		free(obj);
+		obj=NULL;
+	}
+	fclose(f);
+	*size=n;
+	return obj;
+}
+
+int readFull(int fd,void *buf,size_t len) {
+	// Returns 1 if len bytes were read, 0 at end of file or on an error
+	char *p=buf;
+	while(len>0) {
+		ssize_t n=read(fd,p,len);
+		if (n<=0) return 0;
+		p+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+int writeFull(int fd,const void *buf,size_t len) {
+	const char *p=buf;
+	while(len>0) {
+		ssize_t n=write(fd,p,len);
+		if (n<=0) return 0;
+		p+=n;
+		len-=n;
+	}
+	return 1;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "apexFunc.h"
+#include "apexMem.h"
+
+/*---------------------------------------------------------
+This file contains the functional simulation engine. It
+uses the same predecoded instructions, opcode semantics
+(evalOpcode, branchTaken) and memory functions as the
+pipeline model in apexCPU.c, so both engines produce the
+same final registers, condition codes and data memory.
+
+The functional engine only works on architectural state.
+Before switching to it from the pipeline, drainPipeline
+finishes all instructions in flight. Switching from the
+functional engine back to the pipeline needs nothing,
+since the pipeline is empty.
+
+runSampled uses both engines to estimate IPC for long
+programs: the functional engine skips over most of the
+program, and the pipeline only runs the sample windows.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+double tValue95(int df);
+
+/*---------------------------------------------------------
+  External Function definitions
+---------------------------------------------------------*/
+
+int stepFunctional(cpu cpu) {
+	// Returns 1 if an instruction was executed, 0 if the cpu is stopped
+	if (cpu->stop) return 0;
+	const struct apexPredecode_struct *pd=ifetchDecoded(cpu);
+	if (cpu->stop) return 0;
+	if (pd->opcode<0 || pd->opcode>HALT) {
+		cpu->stop=1;
+		sprintf(cpu->abend,"Invalid opcode %x after ifetch(%08x)",pd->opcode,cpu->pc);
+		return 0;
+	}
+	if (cpu->trace) {
+		char instBuf[32];
+		cpuPrintf(cpu,"i=%3d | pc=%05x | %s\n",cpu->func_retired,cpu->pc,disassemble(pd->instruction,instBuf));
+	}
+
+	int op1=0,op2=0;
+	switch(pd->format) {
+		case fmt_dss:
+		case fmt_ssi:
+		case fmt_ss:
+			op1=cpu->reg[pd->sr1];
+			op2=cpu->reg[pd->sr2];
+			break;
+		case fmt_dsi:
+			op1=cpu->reg[pd->sr1];
+			op2=pd->imm;
+			break;
+		case fmt_di:
+			op1=pd->imm;
+			break;
+	}
+
+	int nextPC=cpu->pc+4;
+	switch(pd->opcode) {
+		case NOP:
+			cpu->pc=nextPC;
+			return 1; // NOPs never reach writeback in the pipeline, so are not counted
+		case LOAD: {
+			int value=dfetch(cpu,op1+pd->imm);
+			if (!cpu->stop) cpu->reg[pd->dr]=value;
+			break;
+		}
+		case STORE:
+			dstore(cpu,op1+pd->imm,op2);
+			break;
+		case JUMP:
+		case BZ:
+		case BNZ:
+		case BP:
+		case BNP:
+			if (branchTaken(pd->opcode,cpu->cc)) nextPC=cpu->pc+pd->offset;
+			break;
+		case HALT:
+			cpu->stop=1;
+			cpu->halted=1;
+			strcpy(cpu->abend,"HALT instruction retired");
+			break;
+		default: {
+			int result=evalOpcode(pd->opcode,op1,op2);
+			if (setsConditionCodes(pd->opcode)) {
+				cpu->cc.z=(result==0);
+				cpu->cc.p=(result>0);
+			}
+			if (pd->opcode!=CMP) cpu->reg[pd->dr]=result;
+		}
+	}
+	if (cpu->stop && !cpu->halted) return 0; // Memory fault - instruction did not complete
+	if (!cpu->halted) cpu->pc=nextPC;
+	cpu->func_retired++;
+	return 1;
+}
+
+int runFunctional(cpu cpu,int maxInstructions) {
+	// Runs until stop or maxInstructions (if >0) have executed. Returns number executed
+	int n=0;
+	while((maxInstructions<=0 || n<maxInstructions) && stepFunctional(cpu)) n++;
+	return n;
+}
+
+int pipelineEmpty(cpu cpu) {
+	return cpu->busyMask==0;
+}
+
+void drainPipeline(cpu cpu) {
+	// Stop fetching, and cycle until all instructions in flight have completed.
+	//    Afterwards, cpu->pc is the next instruction to execute
+	cpu->drain=1;
+	while(!cpu->stop && !pipelineEmpty(cpu)) cycleCPU(cpu);
+	cpu->drain=0;
+}
+
+void runSampled(cpu cpu,struct sample_struct *smp) {
+	smp->samples=0;
+	smp->ipcSum=smp->ipcSumSq=0;
+	smp->measuredCycles=smp->measuredRetired=0;
+	if (smp->fastForward>0) runFunctional(cpu,smp->fastForward);
+	while(!cpu->stop) {
+		for(int c=0;c<smp->warmup && !cpu->stop;c++) cycleCPU(cpu);
+		int t0=cpu->t;
+		int r0=cpu->instr_retired;
+		for(int c=0;c<smp->window && !cpu->stop;c++) cycleCPU(cpu);
+		int cycles=cpu->t-t0;
+		int retired=cpu->instr_retired-r0;
+		if (cycles>0) {
+			double ipc=((double)retired)/cycles;
+			smp->samples++;
+			smp->ipcSum+=ipc;
+			smp->ipcSumSq+=ipc*ipc;
+			smp->measuredCycles+=cycles;
+			smp->measuredRetired+=retired;
+		}
+		if (smp->period<=0 || cpu->stop) break;
+		if (smp->maxSamples>0 && smp->samples>=smp->maxSamples) break;
+		drainPipeline(cpu);
+		runFunctional(cpu,smp->period);
+	}
+}
+
+void printSampleStats(cpu cpu,struct sample_struct *smp) {
+	cpuPrintf(cpu,"    Sampling: fast forward %d, warmup %d cycles, window %d cycles, period %d\n",
+		smp->fastForward,smp->warmup,smp->window,smp->period);
+	if (smp->samples==0) {
+		cpuPrintf(cpu,"    No samples taken... program stopped during fast forward\n");
+		return;
+	}
+	double mean=smp->ipcSum/smp->samples;
+	cpuPrintf(cpu,"    Samples: %d, %d cycles and %d instructions measured\n",
+		smp->samples,smp->measuredCycles,smp->measuredRetired);
+	if (smp->samples<2) {
+		cpuPrintf(cpu,"    Sampled IPC estimate: %5.3f (one sample, no confidence interval)\n",mean);
+		return;
+	}
+	double var=(smp->ipcSumSq-smp->samples*mean*mean)/(smp->samples-1);
+	if (var<0) var=0; // Rounding
+	double half=tValue95(smp->samples-1)*sqrt(var/smp->samples);
+	cpuPrintf(cpu,"    Sampled IPC estimate: %5.3f +/- %5.3f (95%% confidence)\n",mean,half);
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+
+double tValue95(int df) {
+	// Two sided 95% Student t value for df degrees of freedom
+	static const double t95[30]={12.706,4.303,3.182,2.776,2.571,2.447,2.365,2.306,2.262,2.228,
+		2.201,2.179,2.160,2.145,2.131,2.120,2.110,2.101,2.093,2.086,
+		2.080,2.074,2.069,2.064,2.060,2.056,2.052,2.048,2.045,2.042};
+	if (df<1) return 0;
+	if (df<=30) return t95[df-1];
+	return 1.960;
+}
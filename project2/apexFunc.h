@@ -0,0 +1,38 @@
+#ifndef APEXFUNC_H // Guard against recursive includes
+#define APEXFUNC_H
+#include "apexCPU.h"
+
+/*---------------------------------------------------------
+  Functional (ISA level) execution engine
+  		Executes one instruction per step against the
+  		architectural state (pc, registers, cc, memory)
+  		with no pipeline timing.
+---------------------------------------------------------*/
+int stepFunctional(cpu cpu);
+int runFunctional(cpu cpu,int maxInstructions);
+int pipelineEmpty(cpu cpu);
+void drainPipeline(cpu cpu);
+
+/*---------------------------------------------------------
+  Sampled simulation - fast forward functionally, then warm
+  		the pipeline and measure IPC over a window of cycles,
+  		optionally repeating every period instructions
+---------------------------------------------------------*/
+struct sample_struct {
+	int fastForward; // instructions executed functionally before the first sample
+	int warmup; // pipeline cycles run before each measurement window
+	int window; // pipeline cycles measured per sample
+	int period; // instructions fast forwarded between samples (0 for one sample)
+	int maxSamples; // stop after this many samples (0 for no limit)
+	// Results
+	int samples;
+	double ipcSum;
+	double ipcSumSq;
+	int measuredCycles;
+	int measuredRetired;
+};
+
+void runSampled(cpu cpu,struct sample_struct *smp);
+void printSampleStats(cpu cpu,struct sample_struct *smp);
+
+#endif
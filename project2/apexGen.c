@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apexOpcodes.h" // Use the same set of opcodes as the simulator!
+#include "apexOpInfo.h" // Include definition of APEX opcodes
+
+/*---------------------------------------------------------
+This file contains a generator of random APEX assembler
+programs, for stress testing the assembler, the loader and
+the simulator with programs of any size.
+
+Opcodes are taken from the opInfo table, and sorted into
+classes (ALU, MUL, LOAD, STORE and branch) so new opcodes
+are generated as soon as they are added to the ISA. Operands
+follow the opcode format.
+
+Every generated program terminates and stays inside its
+memory footprint:
+	- Conditional branches and JUMP only go forward, and never
+	  past the end of the straight line run they are in.
+	- Loops count down a counter register (R13-R15, one per
+	  nesting level) that nothing else writes.
+	- LOAD and STORE address R11 plus an aligned offset below
+	  16384 (and below the footprint). R11 is only written
+	  at the start of a run, where branches can't skip it,
+	  to a multiple of R12 (16384). Larger footprints are a
+	  multiple of 16384, so any offset fits in any block.
+	- The program ends with HALT.
+Data registers are R0-R10, all set by MOVC at the start.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+  Data structures
+---------------------------------------------------------*/
+enum class_enum {
+	cls_alu,
+	cls_mul,
+	cls_load,
+	cls_store,
+	cls_branch,
+	NUMCLASSES
+};
+
+struct genParms_struct {
+	int size; // static instructions to generate
+	int weight[NUMCLASSES];
+	int dep; // mean distance back to the instruction that wrote a source register, 0 for random
+	int depth; // maximum loop nesting
+	int iters; // iterations of each loop
+	int footprint; // bytes of data memory used, from address 0
+	unsigned long long seed;
+};
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void classifyOpcodes();
+int genBody(FILE *f,struct genParms_struct *p,int level,int budget);
+void genRun(FILE *f,struct genParms_struct *p,int len);
+int pickSource();
+int pickDest();
+void setBase(FILE *f,struct genParms_struct *p);
+unsigned int rnd(unsigned int n);
+
+/*---------------------------------------------------------
+  Global Variables
+---------------------------------------------------------*/
+#define NUMDATAREGS 11 // R0-R10
+#define ADDRREG 11
+#define BLOCKREG 12
+#define BLOCKBYTES 16384
+#define MAXDEPTH 3 // counters are R15, R14, R13
+#define HISTORY 64
+
+char *className[NUMCLASSES]={"alu","mul","load","store","branch"};
+int classOps[NUMCLASSES][NUMOPS]; // opcodes in each class
+int classCount[NUMCLASSES];
+int written[HISTORY]; // destination registers of the last HISTORY instructions
+int nWritten=0;
+int depDistance; // see genParms_struct.dep
+int emitted=0;
+unsigned long long rngState;
+
+/*---------------------------------------------------------
+  Main function
+---------------------------------------------------------*/
+int main(int argc,char **argv) {
+	struct genParms_struct p={1000,{50,10,15,10,15},3,2,4,4096,1};
+	char *outFile=NULL;
+	int posArg=1;
+	while (argc>posArg) {
+		int cls=-1;
+		for(int c=0;c<NUMCLASSES;c++) {
+			if (0==strncmp(argv[posArg],"--",2) && 0==strcmp(argv[posArg]+2,className[c])) cls=c;
+		}
+		if (0==strcmp(argv[posArg],"-h")) {
+			printf("APEX random program generator\n");
+			printf("Invoke as: %s [-n <instructions>] [-o <file.s>] [--seed <n>] [--alu <w>] [--mul <w>]\n",argv[0]);
+			printf("       [--load <w>] [--store <w>] [--branch <w>] [--dep <d>] [--loops <depth>]\n");
+			printf("       [--iters <n>] [--footprint <bytes>]\n");
+			printf("Writes a program of about <instructions> instructions (default 1000) to <file.s>\n");
+			printf("   (default stdout). The instruction mix is set by the weights of each class\n");
+			printf("   (default alu 50, mul 10, load 15, store 10, branch 15). Source registers are\n");
+			printf("   written about <d> instructions earlier (default 3, 0 for random). Loops nest\n");
+			printf("   up to <depth> deep (default 2, at most %d) and run <n> times (default 4).\n",MAXDEPTH);
+			printf("   LOAD and STORE use data addresses below <bytes> (default 4096).\n");
+			return 0;
+		} else if (cls>=0 && argc>posArg+1) {
+			p.weight[cls]=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"-n") && argc>posArg+1) {
+			p.size=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"-o") && argc>posArg+1) {
+			outFile=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"--seed") && argc>posArg+1) {
+			p.seed=strtoull(argv[++posArg],NULL,0);
+		} else if (0==strcmp(argv[posArg],"--dep") && argc>posArg+1) {
+			p.dep=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--loops") && argc>posArg+1) {
+			p.depth=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--iters") && argc>posArg+1) {
+			p.iters=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--footprint") && argc>posArg+1) {
+			p.footprint=strtol(argv[++posArg],NULL,0);
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
+		}
+		posArg++;
+	}
+	if (p.depth<0) p.depth=0;
+	if (p.depth>MAXDEPTH) p.depth=MAXDEPTH;
+	if (p.iters<1 || p.iters>32767) {
+		printf("Error - --iters must be from 1 to 32767\n");
+		return 1;
+	}
+	p.footprint&=~3;
+	if (p.footprint<4) {
+		printf("Error - --footprint must be at least 4 bytes\n");
+		return 1;
+	}
+	if (p.footprint>BLOCKBYTES) p.footprint-=p.footprint%BLOCKBYTES;
+	if (p.dep<0) p.dep=0;
+	if (p.dep>HISTORY/2) p.dep=HISTORY/2;
+	depDistance=p.dep;
+
+	classifyOpcodes();
+	int totalWeight=0;
+	for(int c=0;c<NUMCLASSES;c++) {
+		if (p.weight[c]<0 || classCount[c]==0) p.weight[c]=0;
+		totalWeight+=p.weight[c];
+	}
+	if (totalWeight==0) {
+		printf("Error - every instruction class has weight 0\n");
+		return 1;
+	}
+
+	FILE *f=stdout;
+	if (outFile) {
+		f=fopen(outFile,"w");
+		if (f==NULL) {
+			perror("Error - unable to open output file for write");
+			return 1;
+		}
+	}
+	rngState=p.seed?p.seed:1;
+	fprintf(f,"; Generated by apexGen -n %d --seed %llu --alu %d --mul %d --load %d --store %d --branch %d\n",
+		p.size,p.seed,p.weight[cls_alu],p.weight[cls_mul],p.weight[cls_load],p.weight[cls_store],p.weight[cls_branch]);
+	fprintf(f,";    --dep %d --loops %d --iters %d --footprint %d\n",p.dep,p.depth,p.iters,p.footprint);
+	for(int r=0;r<NUMDATAREGS;r++) {
+		fprintf(f,"MOVC R%d,#%d\n",r,(int)rnd(200)-100);
+		emitted++;
+	}
+	fprintf(f,"MOVC R%d,#%d\n",BLOCKREG,BLOCKBYTES);
+	fprintf(f,"MOVC R%d,#0\n",ADDRREG);
+	emitted+=2;
+	int budget=p.size-emitted-1;
+	while(budget>0) budget-=genBody(f,&p,0,budget);
+	fprintf(f,"HALT\n");
+	emitted++;
+	if (outFile) {
+		if (0!=fclose(f)) {
+			perror("Error - writing output file");
+			return 1;
+		}
+		printf("Info - Generated %d instructions into %s\n",emitted,outFile);
+	}
+	return 0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void classifyOpcodes() {
+	// Sorts the opcodes in opInfo into the instruction classes
+	for(int op=0;op<NUMOPS;op++) {
+		int cls;
+		if (op==MUL) cls=cls_mul;
+		else if (op==LOAD) cls=cls_load;
+		else if (op==STORE) cls=cls_store;
+		else if (opInfo[op].format==fmt_off) cls=cls_branch;
+		else if (opInfo[op].format==fmt_nop) continue; // NOP and HALT
+		else cls=cls_alu;
+		classOps[cls][classCount[cls]++]=op;
+	}
+}
+
+int genBody(FILE *f,struct genParms_struct *p,int level,int budget) {
+	// Generates a straight line run, or a loop if not nested too deep.
+	//    Returns the number of instructions generated
+	int start=emitted;
+	if (level<p->depth && budget>=8 && rnd(4)==0) {
+		int counter=15-level;
+		int inner=4+rnd(budget/2>4?budget/2-3:1); // body instructions, less the loop overhead
+		fprintf(f,"MOVC R%d,#%d\n",counter,p->iters);
+		emitted++;
+		int top=emitted;
+		while(inner>0) inner-=genBody(f,p,level+1,inner);
+		fprintf(f,"SUBL R%d,R%d,#1\n",counter,counter);
+		fprintf(f,"BNZ #%d\n",4*(top-emitted-1));
+		emitted+=2;
+	} else {
+		int len=1+rnd(budget<16?budget:16);
+		genRun(f,p,len);
+	}
+	return emitted-start;
+}
+
+void genRun(FILE *f,struct genParms_struct *p,int len) {
+	// Generates len instructions with no loops. Branches stay inside the run
+	int totalWeight=0;
+	for(int c=0;c<NUMCLASSES;c++) totalWeight+=p->weight[c];
+	int window=p->footprint<BLOCKBYTES?p->footprint:BLOCKBYTES;
+	if (p->footprint>BLOCKBYTES && len>=3 && rnd(4)==0) {
+		setBase(f,p);
+		len-=2;
+	}
+	for(int i=0;i<len;i++) {
+		int pick=rnd(totalWeight);
+		int cls=0;
+		while(pick>=p->weight[cls]) pick-=p->weight[cls++];
+		int op=classOps[cls][rnd(classCount[cls])];
+		char *mn=opInfo[op].mnemonic;
+		if (cls==cls_load || cls==cls_store) {
+			int offset=4*rnd(window/4);
+			if (cls==cls_load) fprintf(f,"%s R%d,R%d,#%d\n",mn,pickDest(),ADDRREG,offset);
+			else fprintf(f,"%s R%d,R%d,#%d\n",mn,pickSource(),ADDRREG,offset);
+			emitted++;
+			continue;
+		}
+		switch(opInfo[op].format) {
+			case fmt_dss: {
+				int sr1=pickSource(),sr2=pickSource();
+				fprintf(f,"%s R%d,R%d,R%d\n",mn,pickDest(),sr1,sr2);
+				break;
+			}
+			case fmt_dsi: {
+				int sr1=pickSource();
+				fprintf(f,"%s R%d,R%d,#%d\n",mn,pickDest(),sr1,(int)rnd(200)-100);
+				break;
+			}
+			case fmt_di:
+				fprintf(f,"%s R%d,#%d\n",mn,pickDest(),(int)rnd(200)-100);
+				break;
+			case fmt_ss: {
+				int sr1=pickSource(),sr2=pickSource();
+				fprintf(f,"%s R%d,R%d\n",mn,sr1,sr2);
+				break;
+			}
+			case fmt_ssi: {
+				int sr2=pickSource(),sr1=pickSource();
+				fprintf(f,"%s R%d,R%d,#%d\n",mn,sr2,sr1,(int)rnd(200)-100);
+				break;
+			}
+			case fmt_off: {
+				// Forward, to at most the first instruction after the run
+				int skip=rnd(len-i>4?4:len-i);
+				fprintf(f,"%s #%d\n",mn,4*(skip+1));
+				break;
+			}
+			default:
+				fprintf(f,"NOP\n");
+		}
+		emitted++;
+	}
+}
+
+int pickSource() {
+	// A data register written 1 to 2*dep-1 (dep on average) instructions ago
+	if (depDistance==0 || nWritten==0) return rnd(NUMDATAREGS);
+	int d=1+rnd(2*depDistance-1);
+	if (d>nWritten) d=nWritten;
+	return written[(nWritten-d)%HISTORY];
+}
+
+int pickDest() {
+	int r=rnd(NUMDATAREGS);
+	written[nWritten++%HISTORY]=r;
+	return r;
+}
+
+void setBase(FILE *f,struct genParms_struct *p) {
+	// Points R11 at a random block of the footprint (2 instructions)
+	fprintf(f,"MOVC R%d,#%d\n",ADDRREG,rnd(p->footprint/BLOCKBYTES));
+	fprintf(f,"MUL R%d,R%d,R%d\n",ADDRREG,ADDRREG,BLOCKREG);
+	emitted+=2;
+}
+
+unsigned int rnd(unsigned int n) {
+	// xorshift64*, so a seed gives the same program on every host. Returns 0..n-1
+	rngState^=rngState>>12;
+	rngState^=rngState<<25;
+	rngState^=rngState>>27;
+	if (n==0) return 0;
+	return (unsigned int)((rngState*0x2545F4914F6CDD1Dull)>>32)%n;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apexHist.h"
+#include "apexMem.h"
+
+/*---------------------------------------------------------
+This file keeps the history used by the back and goto
+commands of apexSim.
+
+The pipeline model is deterministic, so any cycle can be
+reached by restoring an earlier state and cycling forward.
+Checkpoints leave out memory (SNAP_NOMEMORY) so they stay
+small no matter how much data the program uses. Instead,
+dstore logs the old value of every word it writes, and
+memory is rolled back by undoing the log from the newest
+store back to the store count saved with the checkpoint.
+
+History only follows the pipeline engine. The functional
+engine does not advance the cycle count, so anything it
+does invalidates the history (see resetHistory).
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void dropOldest(struct history_struct *h);
+void dropAfter(struct history_struct *h,int i);
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+void enableHistory(cpu cpu,struct history_struct *h,int interval,size_t maxBytes) {
+	// Half of maxBytes for checkpoints, half for the store log
+	memset(h,0,sizeof(*h));
+	h->interval=interval>0?interval:1;
+	h->maxBytes=maxBytes;
+	h->log.cap=maxBytes/2/sizeof(struct storeDelta_struct);
+	if (h->log.cap<1) h->log.cap=1;
+	h->log.d=malloc(h->log.cap*sizeof(struct storeDelta_struct));
+	cpu->storeLog=&h->log;
+}
+
+void disableHistory(cpu cpu,struct history_struct *h) {
+	resetHistory(h);
+	free(h->ckpt);
+	free(h->log.d);
+	memset(h,0,sizeof(*h));
+	cpu->storeLog=NULL;
+}
+
+void resetHistory(struct history_struct *h) {
+	// Forgets all history... the next recordHistory starts over
+	dropAfter(h,-1);
+	h->log.tail=h->log.head;
+}
+
+void recordHistory(cpu cpu,struct history_struct *h) {
+	// Call before each pipeline cycle. Takes a checkpoint every interval cycles
+	if (h->log.d==NULL) return;
+	// Checkpoints whose stores have been overwritten in the log can't be rolled back to
+	while(h->n>0 && h->ckpt[0].logPos<h->log.tail) dropOldest(h);
+	if (h->n>0 && cpu->t<h->ckpt[h->n-1].t+h->interval) return;
+	if (h->n==h->size) {
+		h->size=h->size?h->size*2:64;
+		h->ckpt=realloc(h->ckpt,h->size*sizeof(struct checkpoint_struct));
+	}
+	struct checkpoint_struct *c=&h->ckpt[h->n];
+	c->t=cpu->t;
+	c->logPos=h->log.head;
+	memset(&c->snap,0,sizeof(c->snap));
+	if (0!=takeSnapshot(cpu,&c->snap,SNAP_NOMEMORY)) {
+		free(c->snap.data);
+		return;
+	}
+	h->n++;
+	h->ckptBytes+=c->snap.size;
+	while(h->n>1 && h->ckptBytes>h->maxBytes/2) dropOldest(h);
+}
+
+int oldestHistory(struct history_struct *h) {
+	// Returns the earliest cycle that can be gone back to, or -1 if none
+	return h->n>0?h->ckpt[0].t:-1;
+}
+
+int travelTo(cpu cpu,struct history_struct *h,int t) {
+	// Moves the simulation to cycle t. Returns 0 if successful, -1 if t is too far back
+	int trace=cpu->trace;
+	if (t<cpu->t) {
+		int i=h->n-1;
+		while(i>=0 && h->ckpt[i].t>t) i--;
+		if (i<0 || h->ckpt[i].logPos<h->log.tail) return -1;
+		struct checkpoint_struct *c=&h->ckpt[i];
+		// Undo stores, newest first
+		while(h->log.head>c->logPos) {
+			h->log.head--;
+			undoStore(cpu,&h->log.d[h->log.head%h->log.cap]);
+		}
+		if (0!=restoreSnapshot(cpu,c->snap.data,c->snap.len)) return -1;
+		dropAfter(h,i);
+	}
+	// Replay without the pipeline diagram
+	cpu->trace=0;
+	while(cpu->t<t && !cpu->stop) {
+		recordHistory(cpu,h);
+		cycleCPU(cpu);
+	}
+	cpu->trace=trace;
+	return 0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void dropOldest(struct history_struct *h) {
+	h->ckptBytes-=h->ckpt[0].snap.size;
+	free(h->ckpt[0].snap.data);
+	h->n--;
+	memmove(h->ckpt,h->ckpt+1,h->n*sizeof(struct checkpoint_struct));
+	// Stores before the new oldest checkpoint are no longer needed
+	if (h->n>0 && h->log.tail<h->ckpt[0].logPos) h->log.tail=h->ckpt[0].logPos;
+}
+
+void dropAfter(struct history_struct *h,int i) {
+	// Drops every checkpoint after ckpt[i]
+	while(h->n>i+1) {
+		h->n--;
+		h->ckptBytes-=h->ckpt[h->n].snap.size;
+		free(h->ckpt[h->n].snap.data);
+	}
+}
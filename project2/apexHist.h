@@ -0,0 +1,39 @@
+#ifndef APEXHIST_H // Guard against recursive includes
+#define APEXHIST_H
+#include "apexCPU.h"
+#include "apexSnap.h"
+
+/*---------------------------------------------------------
+  Simulation history, for going back in time - snapshots
+  		of everything but memory every interval cycles, and
+  		a log of every store. Going back to cycle t rolls
+  		memory back through the store log, restores the last
+  		checkpoint at or before t, and replays the cycles
+  		from there. Checkpoints and the store log share a
+  		budget of maxBytes, and the oldest history is dropped
+  		when it is used up.
+---------------------------------------------------------*/
+struct checkpoint_struct {
+	int t;
+	size_t logPos; // storeLog head when the checkpoint was taken
+	struct snapshot_struct snap;
+};
+
+struct history_struct {
+	int interval; // cycles between checkpoints
+	size_t maxBytes;
+	struct checkpoint_struct *ckpt; // oldest first
+	int n;
+	int size;
+	size_t ckptBytes;
+	struct storeLog_struct log;
+};
+
+void enableHistory(cpu cpu,struct history_struct *h,int interval,size_t maxBytes);
+void disableHistory(cpu cpu,struct history_struct *h);
+void resetHistory(struct history_struct *h);
+void recordHistory(cpu cpu,struct history_struct *h);
+int oldestHistory(struct history_struct *h);
+int travelTo(cpu cpu,struct history_struct *h,int t);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef APEXHOST_H // Guard against recursive includes
+#define APEXHOST_H
+#include <stdint.h>
+
+/*---------------------------------------------------------
+  Host instrumentation - time spent by the simulator itself
+  		in each part of cycleCPU, measured with the time
+  		stamp counter. Only compiled in when APEX_HOSTSTATS
+  		is defined (make HOSTSTATS=1 after a make clean),
+  		otherwise HOST_BEGIN and HOST_END are empty.
+  		Sections nest: time in reportStage is also part of
+  		the stage that called it.
+---------------------------------------------------------*/
+enum host_enum {
+	host_cycle, // all of cycleCPU
+	host_advance, // moving latches down the pipeline and issue
+	host_fetch,
+	host_decode, // the decode part of d/rf, cycle_stage(decode) is the rf part
+	host_stage, // cycle_stage, one entry per stage (host_stage+s)
+	host_perf=host_stage+18, // stall and FU busy counters
+	host_report=host_perf+1, // reportStage
+	host_print, // pipeline diagram and printState
+	NUMHOST
+};
+
+struct hostStats_struct {
+	uint64_t ticks[NUMHOST];
+	uint64_t calls[NUMHOST];
+	uint64_t startTicks; // when the counters were reset, to calibrate ticks
+	int64_t startNs;
+	int startT; // cpu->t when the counters were reset
+};
+
+#ifdef APEX_HOSTSTATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t hostTicks(void) {
+	return __rdtsc();
+}
+#else
+#include <time.h>
+static inline uint64_t hostTicks(void) {
+	struct timespec ts;
+	timespec_get(&ts,TIME_UTC);
+	return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+#endif
+#define HOST_BEGIN(var) uint64_t var=hostTicks()
+#define HOST_END(cpu,section,var) do { \
+		(cpu)->host.ticks[section]+=hostTicks()-(var); \
+		(cpu)->host.calls[section]++; \
+	} while(0)
+#else
+#define HOST_BEGIN(var)
+#define HOST_END(cpu,section,var)
+#endif
+
+#endif
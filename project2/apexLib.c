@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+#include "apexLib.h"
+#include "apexCPU.h"
+#include "apexMem.h"
+#include "apexProf.h"
+
+/*---------------------------------------------------------
+This file is the embedding API of libapexsim (see
+apexLib.h). It is a thin layer over the same cpu that
+apexSim drives: an apex_sim is an apexCPU_struct, with
+trace off and cpu->output pointed at the caller's callback
+(or at dropOutput), so cpuPrintf never reaches stdout.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void dropOutput(void *ctx,const char *text);
+void resetSim(apex_sim *sim);
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+apex_sim * apex_create(apex_output_fn output,void *ctx) {
+	apex_sim *sim=malloc(sizeof(struct apexCPU_struct));
+	if (sim==NULL) return NULL;
+	initCPU(sim);
+	sim->trace=0;
+	sim->output=output?output:dropOutput;
+	sim->outputCtx=ctx;
+	return sim;
+}
+
+void apex_set_trace(apex_sim *sim,int on) {
+	sim->trace=on;
+}
+
+int apex_load_from_buffer(apex_sim *sim,const void *obj,size_t size) {
+	resetSim(sim);
+	return loadBuffer(sim,"buffer",obj,size);
+}
+
+int apex_run(apex_sim *sim,int cycles) {
+	if (sim->numInstructions==0) return 0;
+	int start=sim->t;
+	while(!sim->stop && sim->t-start<cycles) cycleCPU(sim);
+	return sim->t-start;
+}
+
+void apex_get_stats(apex_sim *sim,struct apex_stats *stats) {
+	memset(stats,0,sizeof(*stats));
+	stats->cycles=sim->t;
+	stats->instructions=sim->instr_retired;
+	stats->stopped=sim->stop;
+	stats->halted=sim->halted;
+	if (sim->stop) strcpy(stats->stopReason,sim->abend);
+	stats->rawStallCycles=sim->perf.cpi[cpi_raw];
+	stats->wawStallCycles=sim->perf.cpi[cpi_waw];
+	stats->branchBubbleCycles=sim->perf.cpi[cpi_branch];
+	stats->branchesTaken=sim->perf.branchTaken;
+}
+
+int apex_read_reg(apex_sim *sim,int reg,int *value) {
+	if (reg<0 || reg>15) return -1;
+	*value=sim->reg[reg];
+	return 0;
+}
+
+int apex_read_mem(apex_sim *sim,int addr,int *value) {
+	if ((unsigned int)addr>=sim->memSize || 0!=addr%4) return -1;
+	*value=0;
+	return peekData(sim,addr,value);
+}
+
+void apex_destroy(apex_sim *sim) {
+	if (sim==NULL) return;
+	freeProfile(sim);
+	freeMem(sim);
+	free(sim);
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void dropOutput(void *ctx,const char *text) {
+	// No callback... the library never prints
+}
+
+void resetSim(apex_sim *sim) {
+	// A fresh cpu and memory, keeping the caller's settings
+	apexOutputFn output=sim->output;
+	void *outputCtx=sim->outputCtx;
+	int trace=sim->trace;
+	unsigned int memSize=sim->memSize;
+	freeProfile(sim);
+	freeMem(sim);
+	initCPU(sim);
+	sim->output=output;
+	sim->outputCtx=outputCtx;
+	sim->trace=trace;
+	sim->memSize=memSize;
+}
@@ -0,0 +1,65 @@
+#ifndef APEXLIB_H // Guard against recursive includes
+#define APEXLIB_H
+#include <stddef.h>
+
+/*---------------------------------------------------------
+  libapexsim - the APEX pipeline simulator as a library
+  		(make lib builds libapexsim.a and libapexsim.so)
+
+  Nothing is written to stdout. Text the simulator would
+  print (load errors, and the pipeline diagram if trace is
+  turned on) is passed to the output callback, or dropped
+  if there is none. A simulator can be reused: each load
+  starts over with a fresh cpu and memory.
+
+  	apex_sim *sim=apex_create(NULL,NULL);
+  	if (apex_load_from_buffer(sim,obj,size)>0) {
+  		while(apex_run(sim,100000)>0);
+  		apex_get_stats(sim,&stats);
+  	}
+  	apex_destroy(sim);
+---------------------------------------------------------*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define APEX_API __attribute__((visibility("default")))
+
+typedef struct apexCPU_struct apex_sim;
+typedef void (*apex_output_fn)(void *ctx,const char *text);
+
+struct apex_stats {
+	int cycles;
+	int instructions; // retired
+	int stopped;
+	int halted; // stopped because HALT retired
+	char stopReason[64]; // empty unless stopped
+	int rawStallCycles; // decode stalled for a source register
+	int wawStallCycles; // decode stalled for its destination register
+	int branchBubbleCycles; // bubbles behind taken branches
+	int branchesTaken;
+};
+
+// Returns a new simulator, or NULL if out of memory. output may be NULL
+APEX_API apex_sim * apex_create(apex_output_fn output,void *ctx);
+// Prints the pipeline diagram, one row per cycle, through the output callback
+APEX_API void apex_set_trace(apex_sim *sim,int on);
+// Loads a binary object (apexAsm output) from memory, replacing any program
+//    and data already loaded. Returns the number of instructions, or -1
+APEX_API int apex_load_from_buffer(apex_sim *sim,const void *obj,size_t size);
+// Runs at most cycles cycles. Returns the number run, 0 once the cpu has stopped
+APEX_API int apex_run(apex_sim *sim,int cycles);
+APEX_API void apex_get_stats(apex_sim *sim,struct apex_stats *stats);
+// Returns 0, or -1 if reg is not 0-15
+APEX_API int apex_read_reg(apex_sim *sim,int reg,int *value);
+// Returns 1, 0 if the word was never written (value is set to 0), or -1 if
+//    addr is outside data memory or not a multiple of 4
+APEX_API int apex_read_mem(apex_sim *sim,int addr,int *value);
+APEX_API void apex_destroy(apex_sim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,21 +1,71 @@
 #include "apexMem.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void * findPage(struct pageTable_struct *pt,unsigned int vpn,size_t pageSize,int alloc);
+void countUninitRead(cpu cpu,int addr);
+int nextBit(struct pageTable_struct *pt,size_t bitsOffset,int from);
+int compareUninit(const void *a,const void *b);
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+void initMem(cpu cpu) {
+	// Assumes the page tables are not in use... see freeMem
+	memset(&cpu->codePages,0,sizeof(cpu->codePages));
+	memset(&cpu->dataPages,0,sizeof(cpu->dataPages));
+	memset(&cpu->uninit,0,sizeof(cpu->uninit));
+	cpu->watchHit=0;
+	cpu->storeLog=NULL;
+	cpu->itlb.vpn=cpu->dtlb.vpn=~0u;
+	cpu->itlb.page=cpu->dtlb.page=NULL;
+	cpu->memSize=DEFAULT_MEMSIZE;
+}
+
+void freeMem(cpu cpu) {
+	freePages(&cpu->codePages);
+	freePages(&cpu->dataPages);
+	free(cpu->uninit.tbl);
+	memset(&cpu->uninit,0,sizeof(cpu->uninit));
+	cpu->itlb.vpn=cpu->dtlb.vpn=~0u;
+	cpu->itlb.page=cpu->dtlb.page=NULL;
+}
+
+void storeCode(cpu cpu,int inum,int instruction) {
+	// Loads and predecodes instruction number inum
+	struct codePage_struct *page=findPage(&cpu->codePages,inum>>(PAGEBITS-2),sizeof(*page),1);
+	predecode(cpu->ops,instruction,&page->pd[inum%PAGEWORDS]);
+}
 
 int ifetch(cpu cpu) {
+	const struct apexPredecode_struct *pd=ifetchDecoded(cpu);
+	return pd?pd->instruction:0;
+}
+
+const struct apexPredecode_struct * ifetchDecoded(cpu cpu) {
+	// Same as ifetch, but returns the instruction predecoded by loadCPU
 	int addr=cpu->pc;
 	int idx=(addr-0x4000)/4;
 	if (idx<0 || idx>=cpu->numInstructions || 0!=addr%4) {
 		cpu->stop=1;
 		sprintf(cpu->abend,"Segmentation violation in ifetch pc=%08x",addr);
-		return 0;
+		return NULL;
 	}
-	return cpu->codeMem[idx];
+	unsigned int vpn=idx>>(PAGEBITS-2);
+	if (vpn!=cpu->itlb.vpn) {
+		cpu->itlb.page=findPage(&cpu->codePages,vpn,sizeof(struct codePage_struct),0);
+		cpu->itlb.vpn=vpn;
+	}
+	return &((struct codePage_struct *)cpu->itlb.page)->pd[idx%PAGEWORDS];
 }
 
 int dfetch(cpu cpu,int addr) {
-	int idx=addr/4;
-	if (idx<0 || idx>127) {
+	if ((unsigned int)addr>=cpu->memSize) {
 		cpu->stop=1;
 		sprintf(cpu->abend,"dfetch segmentation violation - address %08x out of range",addr);
 		return 0;
@@ -25,22 +75,17 @@ int dfetch(cpu cpu,int addr) {
 		sprintf(cpu->abend,"dfetch segmentation: %08x not a multiple of 4",addr);
 		return 0;
 	}
-	if (idx<cpu->lowMem) {
-		cpu->lowMem=idx;
-		printf("Warning... accessing uninitialized memory at address %08x\n",addr);
-		cpu->dataMem[idx]=0;
-	}
-	if (idx>cpu->highMem) {
-		cpu->highMem=idx;
-		printf("Warning... accessing uninitialized memory at address %08x\n",addr);
-		cpu->dataMem[idx]=0;
+	int idx=(addr/4)%PAGEWORDS;
+	struct dataPage_struct *page=dataPage(cpu,addr>>PAGEBITS,0);
+	if (page==NULL || !(page->written[idx/32]&(1u<<(idx%32)))) {
+		countUninitRead(cpu,addr);
+		return page?page->word[idx]:0; // Unwritten words read as zero
 	}
-	return cpu->dataMem[idx];
+	return page->word[idx];
 }
 
 void dstore(cpu cpu,int addr,int value) {
-	int idx=addr/4;
-	if (idx<0 || idx>127) {
+	if ((unsigned int)addr>=cpu->memSize) {
 		cpu->stop=1;
 		sprintf(cpu->abend,"dfetch segmentation: %08x out of range",addr);
 		return;
@@ -50,7 +95,228 @@ void dstore(cpu cpu,int addr,int value) {
 		sprintf(cpu->abend,"dfetch segmentation: %08x not a multiple of 4",addr);
 		return;
 	}
-	if (idx<cpu->lowMem) cpu->lowMem=idx;
-	if (idx>cpu->highMem) cpu->highMem=idx;
-	cpu->dataMem[idx]=value;
+	int idx=(addr/4)%PAGEWORDS;
+	struct dataPage_struct *page=dataPage(cpu,addr>>PAGEBITS,1);
+	if (cpu->storeLog) {
+		struct storeLog_struct *log=cpu->storeLog;
+		struct storeDelta_struct *e=&log->d[log->head%log->cap];
+		e->addr=addr;
+		e->old=page->word[idx];
+		e->written=(page->written[idx/32]>>(idx%32))&1;
+		log->head++;
+		if (log->head-log->tail>log->cap) log->tail++;
+	}
+	page->word[idx]=value;
+	page->written[idx/32]|=1u<<(idx%32);
+	if (page->watched[idx/32]&(1u<<(idx%32))) {
+		cpu->watchHit=1;
+		cpu->watchAddr=addr;
+	}
+}
+
+int peekData(cpu cpu,int addr,int *value) {
+	// Reads data memory with no side effects. Returns 0 if the word was never written
+	if ((unsigned int)addr>=cpu->memSize || 0!=addr%4) return 0;
+	struct dataPage_struct *page=findPage(&cpu->dataPages,(unsigned int)addr>>PAGEBITS,sizeof(*page),0);
+	int idx=(addr/4)%PAGEWORDS;
+	if (page==NULL || !(page->written[idx/32]&(1u<<(idx%32)))) return 0;
+	*value=page->word[idx];
+	return 1;
+}
+
+void printWritten(cpu cpu) {
+	// Prints every data word that has been written, in address order
+	const size_t bits=offsetof(struct dataPage_struct,written);
+	int i=nextBit(&cpu->dataPages,bits,0);
+	if (i<0) return;
+	cpuPrintf(cpu,"Modified memory:\n");
+	for(;i>=0;i=nextBit(&cpu->dataPages,bits,i+1)) {
+		int value=0;
+		peekData(cpu,4*i,&value);
+		cpuPrintf(cpu,"MEM[%04x]=%d\n",4*i,value);
+	}
+	cpuPrintf(cpu,"\n");
+}
+
+void printUninitReads(cpu cpu) {
+	// Summary of reads of unwritten data words, one line per address
+	struct uninitReads_struct *u=&cpu->uninit;
+	if (u->total==0) return;
+	cpuPrintf(cpu,"    Reads of uninitialized memory: %d, at %d address%s\n",u->total,u->n,u->n==1?"":"es");
+	struct uninitRead_struct *list=malloc(u->n*sizeof(*list));
+	int n=0;
+	for(int i=0;i<u->size;i++) if (u->tbl[i].count) list[n++]=u->tbl[i];
+	qsort(list,n,sizeof(*list),compareUninit);
+	for(int i=0;i<n;i++) {
+		cpuPrintf(cpu,"      MEM[%04x] read %d time%s, first at cycle %d\n",
+			list[i].addr,list[i].count,list[i].count==1?"":"s",list[i].firstCycle);
+	}
+	free(list);
+}
+
+int toggleBreak(cpu cpu,int inum) {
+	// Sets or clears the breakpoint on instruction inum. Returns 1 if now set, -1 if inum is invalid
+	if (inum<0 || inum>=cpu->numInstructions) return -1;
+	struct codePage_struct *page=findPage(&cpu->codePages,inum>>(PAGEBITS-2),sizeof(*page),0);
+	int idx=inum%PAGEWORDS;
+	page->breakpt[idx/32]^=1u<<(idx%32);
+	return (page->breakpt[idx/32]>>(idx%32))&1;
+}
+
+int isBreak(cpu cpu,int pc) {
+	int inum=(pc-0x4000)/4;
+	if (inum<0 || inum>=cpu->numInstructions || 0!=pc%4) return 0;
+	struct codePage_struct *page=findPage(&cpu->codePages,inum>>(PAGEBITS-2),sizeof(*page),0);
+	int idx=inum%PAGEWORDS;
+	return (page->breakpt[idx/32]>>(idx%32))&1;
+}
+
+int peekCode(cpu cpu,int inum,int *instruction) {
+	// Reads code memory with no side effects. Returns 0 if there is no instruction inum
+	if (inum<0 || inum>=cpu->numInstructions) return 0;
+	struct codePage_struct *page=findPage(&cpu->codePages,(unsigned int)inum/PAGEWORDS,sizeof(*page),0);
+	if (page==NULL) return 0;
+	*instruction=page->pd[inum%PAGEWORDS].instruction;
+	return 1;
+}
+
+const struct apexPredecode_struct * peekDecoded(cpu cpu,int pc) {
+	// ifetchDecoded with no side effects. Returns NULL if there is no instruction at pc
+	int idx=(pc-0x4000)/4;
+	if (idx<0 || idx>=cpu->numInstructions || 0!=pc%4) return NULL;
+	struct codePage_struct *page=findPage(&cpu->codePages,(unsigned int)idx/PAGEWORDS,sizeof(*page),0);
+	if (page==NULL) return NULL;
+	return &page->pd[idx%PAGEWORDS];
+}
+void listBreaks(cpu cpu) {
+	const size_t bits=offsetof(struct codePage_struct,breakpt);
+	int i=nextBit(&cpu->codePages,bits,0);
+	if (i<0) cpuPrintf(cpu,"No breakpoints\n");
+	for(;i>=0;i=nextBit(&cpu->codePages,bits,i+1)) {
+		cpuPrintf(cpu,"Breakpoint at I%d (pc=%05x)\n",i,0x4000+4*i);
+	}
+}
+
+int toggleWatch(cpu cpu,int addr) {
+	// Sets or clears the watchpoint on stores to addr. Returns 1 if now set, -1 if addr is invalid
+	if ((unsigned int)addr>=cpu->memSize || 0!=addr%4) return -1;
+	struct dataPage_struct *page=dataPage(cpu,addr>>PAGEBITS,1);
+	int idx=(addr/4)%PAGEWORDS;
+	page->watched[idx/32]^=1u<<(idx%32);
+	return (page->watched[idx/32]>>(idx%32))&1;
+}
+
+void listWatches(cpu cpu) {
+	const size_t bits=offsetof(struct dataPage_struct,watched);
+	int i=nextBit(&cpu->dataPages,bits,0);
+	if (i<0) cpuPrintf(cpu,"No watchpoints\n");
+	for(;i>=0;i=nextBit(&cpu->dataPages,bits,i+1)) {
+		cpuPrintf(cpu,"Watchpoint on MEM[%04x]\n",4*i);
+	}
+}
+
+void undoStore(cpu cpu,const struct storeDelta_struct *e) {
+	// Puts back the word a logged store replaced
+	int idx=(e->addr/4)%PAGEWORDS;
+	struct dataPage_struct *page=dataPage(cpu,e->addr>>PAGEBITS,1);
+	page->word[idx]=e->old;
+	if (e->written) page->written[idx/32]|=1u<<(idx%32);
+	else page->written[idx/32]&=~(1u<<(idx%32));
+}
+
+struct dataPage_struct * dataPage(cpu cpu,unsigned int vpn,int alloc) {
+	// Page lookup through the data tlb... misses are not cached
+	if (vpn==cpu->dtlb.vpn) return cpu->dtlb.page;
+	struct dataPage_struct *page=findPage(&cpu->dataPages,vpn,sizeof(*page),alloc);
+	if (page!=NULL) {
+		cpu->dtlb.vpn=vpn;
+		cpu->dtlb.page=page;
+	}
+	return page;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void * findPage(struct pageTable_struct *pt,unsigned int vpn,size_t pageSize,int alloc) {
+	// Returns page number vpn, or NULL if it does not exist and alloc is false
+	void ***dir=&pt->dir[(vpn>>DIRBITS)%DIRSIZE];
+	if (*dir==NULL) {
+		if (!alloc) return NULL;
+		*dir=calloc(DIRSIZE,sizeof(void *));
+	}
+	void **page=&(*dir)[vpn%DIRSIZE];
+	if (*page==NULL && alloc) {
+		*page=calloc(1,pageSize);
+		pt->pages++;
+	}
+	return *page;
+}
+
+void countUninitRead(cpu cpu,int addr) {
+	struct uninitReads_struct *u=&cpu->uninit;
+	if (2*(u->n+1)>u->size) { // Grow the hash table, keeping it at most half full
+		int oldSize=u->size;
+		struct uninitRead_struct *old=u->tbl;
+		u->size=oldSize?oldSize*2:64;
+		u->tbl=calloc(u->size,sizeof(*u->tbl));
+		for(int i=0;i<oldSize;i++) {
+			if (old[i].count==0) continue;
+			unsigned int h=((unsigned int)old[i].addr>>2)*2654435761u;
+			while(u->tbl[h&(u->size-1)].count) h++;
+			u->tbl[h&(u->size-1)]=old[i];
+		}
+		free(old);
+	}
+	unsigned int h=((unsigned int)addr>>2)*2654435761u;
+	struct uninitRead_struct *slot;
+	while((slot=&u->tbl[h&(u->size-1)])->count && slot->addr!=addr) h++;
+	if (slot->count==0) {
+		slot->addr=addr;
+		slot->firstCycle=cpu->t;
+		u->n++;
+	}
+	slot->count++;
+	u->total++;
+}
+
+int nextBit(struct pageTable_struct *pt,size_t bitsOffset,int from) {
+	// Returns the index of the first word at or after from whose bit is set in
+	//    the bitmap bitsOffset bytes into each page, or -1 if there is none
+	int first=1;
+	for(unsigned int vpn=from/PAGEWORDS;vpn<DIRSIZE*DIRSIZE;vpn++,first=0) {
+		void **dir=pt->dir[vpn/DIRSIZE];
+		if (dir==NULL) {
+			vpn|=DIRSIZE-1; // Skip the rest of an empty directory
+			continue;
+		}
+		if (dir[vpn%DIRSIZE]==NULL) continue;
+		const unsigned int *bits=(const unsigned int *)((char *)dir[vpn%DIRSIZE]+bitsOffset);
+		for(int w=first?from%PAGEWORDS:0;w<PAGEWORDS;w=(w/32+1)*32) {
+			unsigned int b=bits[w/32]>>(w%32);
+			if (b) return vpn*PAGEWORDS+w+__builtin_ctz(b);
+		}
+	}
+	return -1;
+}
+
+int compareUninit(const void *a,const void *b) {
+	const struct uninitRead_struct *ua=a,*ub=b;
+	return (unsigned int)ua->addr<(unsigned int)ub->addr?-1:(ua->addr!=ub->addr);
+}
+
+void freePages(struct pageTable_struct *pt) {
+	// Stops after the last allocated page... small programs only use a few pages at the bottom,
+	//    and findPage never allocates a second level table without a page in it
+	for(int d=0;d<DIRSIZE && pt->pages>0;d++) {
+		if (pt->dir[d]==NULL) continue;
+		for(int p=0;p<DIRSIZE && pt->pages>0;p++) {
+			if (pt->dir[d][p]==NULL) continue;
+			free(pt->dir[d][p]);
+			pt->pages--;
+		}
+		free(pt->dir[d]);
+		pt->dir[d]=NULL;
+	}
+	pt->pages=0;
 }
\ No newline at end of file
@@ -2,8 +2,25 @@
 #define APEXMEM_H
 #include "apexCPU.h"
 
+void initMem(cpu cpu);
+void freeMem(cpu cpu);
+void storeCode(cpu cpu,int inum,int instruction);
 int ifetch(cpu cpu);
+const struct apexPredecode_struct * ifetchDecoded(cpu cpu);
 int dfetch(cpu cpu,int addr);
 void dstore(cpu cpu,int addr,int value);
+int peekData(cpu cpu,int addr,int *value);
+int peekCode(cpu cpu,int inum,int *instruction);
+const struct apexPredecode_struct * peekDecoded(cpu cpu,int pc);
+struct dataPage_struct * dataPage(cpu cpu,unsigned int vpn,int alloc);
+void freePages(struct pageTable_struct *pt);
+void undoStore(cpu cpu,const struct storeDelta_struct *e);
+void printWritten(cpu cpu);
+void printUninitReads(cpu cpu);
+int toggleBreak(cpu cpu,int inum);
+int isBreak(cpu cpu,int pc);
+void listBreaks(cpu cpu);
+int toggleWatch(cpu cpu,int addr);
+void listWatches(cpu cpu);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef APEXOBJ_H // Guard against recursive includes
+#define APEXOBJ_H
+#include <stdint.h>
+
+/*---------------------------------------------------------
+This file defines the binary APEX object format, written by
+apexAsm and mapped directly into memory by loadCPU.
+
+All fields are 32 bit words in host byte order. The file is:
+	header
+	code section    - codeWords instruction words, loaded at codeAddr
+	data section    - dataWords data words, loaded at dataAddr
+	line table      - numLines apexObjLine_struct entries
+	symbol table    - numSymbols apexObjSymbol_struct entries
+	string table    - strBytes bytes of '\0' terminated strings
+
+Any section may be empty. Strings are referenced by their
+byte offset in the string table.
+
+The text object format (one hex instruction per line, with
+an optional ';' comment) is still accepted by loadCPU.
+---------------------------------------------------------*/
+
+#define APEXOBJ_MAGIC 0x4f585041 // "APXO" when stored little endian
+#define APEXOBJ_VERSION 1
+
+struct apexObjHeader_struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t codeAddr;
+	uint32_t codeWords;
+	uint32_t dataAddr;
+	uint32_t dataWords;
+	uint32_t numLines;
+	uint32_t numSymbols;
+	uint32_t strBytes;
+};
+
+struct apexObjLine_struct {
+	uint32_t inum; // Instruction number
+	uint32_t srcLine; // Line number in the assembler source
+	uint32_t text; // String table offset of the assembler source line
+};
+
+struct apexObjSymbol_struct {
+	uint32_t value;
+	uint32_t name; // String table offset of the symbol name
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 /*---------------------------------------------------------
 This file contains a C function for each opcode and
@@ -24,83 +25,75 @@ you add new opcodes to be simulated, code the
 functions for each stage for that opcode, and add
 an invocation of registerOpcode to the
 registerAllOpcodes function.
+
+The functions only use the cpu passed to them, and the
+dispatch table is built once and never modified, so any
+number of cpus can be simulated at the same time.
 ---------------------------------------------------------*/
 
 /*---------------------------------------------------------
   Helper Function Declarations
 ---------------------------------------------------------*/
+void buildDefaultOps();
 void fetch_register1(cpu cpu);
 void fetch_register2(cpu cpu);
 void check_dest(cpu cpu);
-void set_conditionCodes(cpu cpu);
-void exForward(cpu cpu);
+void set_conditionCodes(cpu cpu,int stage);
+void exForward(cpu cpu,int stage);
 
 /*---------------------------------------------------------
   Global Variables
 ---------------------------------------------------------*/
-opStageFn opFns[18][NUMOPS]={NULL}; // Array of function pointers, one for each stage/opcode combination
+static struct opTable_struct defaultOps; // Built once by defaultOpTable
+static pthread_once_t defaultOpsOnce=PTHREAD_ONCE_INIT;
 
 
 /*---------------------------------------------------------
   Decode stage functions
 ---------------------------------------------------------*/
 void nop_decode(cpu cpu) {
-	cpu->stage[decode].func=alu;
+	// Nothing to decode... the FU comes from the predecoded instruction
 }
 
 void dss_decode(cpu cpu) {
-	cpu->stage[decode].status=stage_noAction;
+	setStatus(cpu,decode,stage_noAction);
 	fetch_register1(cpu);
 	fetch_register2(cpu);
 	check_dest(cpu);
-	if(cpu->stage[decode].opcode==AND || cpu->stage[decode].opcode==OR || cpu->stage[decode].opcode==XOR || cpu->stage[decode].opcode==ADD || cpu->stage[decode].opcode==SUB)
-	cpu->stage[decode].func=alu;
-	if (cpu->stage[decode].opcode==MUL)
-	cpu->stage[decode].func=mul;
 }
 void dsi_decode(cpu cpu) {
-	cpu->stage[decode].status=stage_noAction;
+	setStatus(cpu,decode,stage_noAction);
 	fetch_register1(cpu);
 	check_dest(cpu);
-	if(cpu->stage[decode].opcode==ADDL || cpu->stage[decode].opcode==SUBL)
-	cpu->stage[decode].func=alu;
-	if (cpu->stage[decode].opcode==LOAD)
-	cpu->stage[decode].func=ldr;
 }
 
 void ssi_decode(cpu cpu) {
-	cpu->stage[decode].status=stage_noAction;
+	setStatus(cpu,decode,stage_noAction);
 	fetch_register1(cpu);
 	fetch_register2(cpu);
-	if(cpu->stage[decode].opcode==CMP)
-	cpu->stage[decode].func=alu;
-	if (cpu->stage[decode].opcode==STORE)
-	cpu->stage[decode].func=str;
 }
 
 void movc_decode(cpu cpu) {
-	cpu->stage[decode].status=stage_noAction;
+	setStatus(cpu,decode,stage_noAction);
 	check_dest(cpu);
-	cpu->stage[decode].func=alu;
 }
 
 void cbranch_decode(cpu cpu) {
-	cpu->stage[decode].branch_taken=0;
-	cpu->stage[decode].func=brz;
-	if (cpu->stage[decode].opcode==JUMP) cpu->stage[decode].branch_taken=1;
-	if (cpu->stage[decode].opcode==BZ && cpu->cc.z) cpu->stage[decode].branch_taken=1;
-	if (cpu->stage[decode].opcode==BNZ && !cpu->cc.z) cpu->stage[decode].branch_taken=1;
-	if (cpu->stage[decode].opcode==BP && cpu->cc.p) cpu->stage[decode].branch_taken=1;
-	if (cpu->stage[decode].opcode==BNP && !cpu->cc.p) cpu->stage[decode].branch_taken=1;
-	if (cpu->stage[decode].branch_taken) {
+	cpu->stage[decode]->branch_taken=branchTaken(cpu->stage[decode]->opcode,cpu->cc);
+	if (cpu->stage[decode]->branch_taken) {
 		// Squash instruction currently in fetch
-		cpu->stage[fetch].instruction=0;
-		cpu->stage[fetch].status=stage_squashed;
-		reportStage(cpu,fetch," squashed by previous branch");
+		cpu->stage[fetch]->instruction=0;
+		setStatus(cpu,fetch,stage_squashed);
+		cpu->stage[fetch]->bubble=cpi_branch;
+		cpu->stage[fetch]->bubblePc=cpu->stage[decode]->pc;
+		cpu->perf.fetchBubble=cpi_branch;
+		cpu->perf.fetchBubblePc=cpu->stage[decode]->pc;
+		cpu->perf.branchTaken++;
+		reportStage(cpu,fetch,ev_squashedByBranch,0,0,0);
 		cpu->halt_fetch=1;
-		reportStage(cpu,decode," branch taken");
+		reportStage(cpu,decode,ev_branchTaken,0,0,0);
 	} else {
-	  reportStage(cpu,decode," branch not taken");
+	  reportStage(cpu,decode,ev_branchNotTaken,0,0,0);
   }
 }
 
@@ -112,23 +105,23 @@ void nop_execute1(cpu cpu) {
 }
 
 void nop_execute2(cpu cpu) {
-	cpu->stage[alu1].status = stage_squashed;
-	cpu->stage[alu1].instruction = 0;
-	cpu->stage[alu1].opcode = 0;
+	setStatus(cpu,alu1,stage_squashed);
+	cpu->stage[alu1]->instruction = 0;
+	cpu->stage[alu1]->opcode = 0;
 }
 
 void nop_execute3(cpu cpu) {
 	cpu->pipearr[0]=1;
-	cpu->stage[alu2].status = stage_squashed;
-	cpu->stage[alu1].instruction = 0;
-	cpu->stage[alu1].opcode = 0;
+	setStatus(cpu,alu2,stage_squashed);
+	cpu->stage[alu1]->instruction = 0;
+	cpu->stage[alu1]->opcode = 0;
 }
 
 void add_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1+cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"res=%d+%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	set_conditionCodes(cpu);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(cpu->stage[alu1]->opcode,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_add,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	set_conditionCodes(cpu,alu1);
+	exForward(cpu,alu1);
 }
 
 void add_execute3(cpu cpu) {
@@ -136,10 +129,10 @@ void add_execute3(cpu cpu) {
 }
 
 void sub_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1-cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"res=%d-%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	set_conditionCodes(cpu);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(cpu->stage[alu1]->opcode,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_sub,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	set_conditionCodes(cpu,alu1);
+	exForward(cpu,alu1);
 }
 
 void sub_execute3(cpu cpu) {
@@ -147,9 +140,9 @@ void sub_execute3(cpu cpu) {
 }
 
 void cmp_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1-cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"cc based on %d-%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	set_conditionCodes(cpu);
+	cpu->stage[alu1]->result=evalOpcode(CMP,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_cmp,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	set_conditionCodes(cpu,alu1);
 	// exForward(cpu);
 }
 
@@ -158,10 +151,10 @@ void cmp_execute3(cpu cpu) {
 }
 
 void mul_execute1(cpu cpu) {
-	cpu->stage[mul1].result=cpu->stage[mul1].op1*cpu->stage[mul1].op2;
-	reportStage(cpu,mul1,"res=%d*%d",cpu->stage[mul1].op1,cpu->stage[mul1].op2);
-	set_conditionCodes(cpu);
-	exForward(cpu);
+	cpu->stage[mul1]->result=evalOpcode(cpu->stage[mul1]->opcode,cpu->stage[mul1]->op1,cpu->stage[mul1]->op2);
+	reportStage(cpu,mul1,ev_mul,0,cpu->stage[mul1]->op1,cpu->stage[mul1]->op2);
+	set_conditionCodes(cpu,mul1);
+	exForward(cpu,mul1);
 }
 
 void mul_execute3(cpu cpu) {
@@ -169,9 +162,9 @@ void mul_execute3(cpu cpu) {
 }
 
 void and_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1&cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"res=%d&%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(cpu->stage[alu1]->opcode,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_and,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	exForward(cpu,alu1);
 }
 
 void and_execute3(cpu cpu) {
@@ -179,9 +172,9 @@ void and_execute3(cpu cpu) {
 }
 
 void or_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1|cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"res=%d|%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(cpu->stage[alu1]->opcode,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_or,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	exForward(cpu,alu1);
 }
 
 void or_execute3(cpu cpu) {
@@ -189,9 +182,9 @@ void or_execute3(cpu cpu) {
 }
 
 void xor_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1^cpu->stage[alu1].op2;
-	reportStage(cpu,alu1,"res=%d^%d",cpu->stage[alu1].op1,cpu->stage[alu1].op2);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(cpu->stage[alu1]->opcode,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	reportStage(cpu,alu1,ev_xor,0,cpu->stage[alu1]->op1,cpu->stage[alu1]->op2);
+	exForward(cpu,alu1);
 }
 
 void xor_execute3(cpu cpu) {
@@ -199,9 +192,9 @@ void xor_execute3(cpu cpu) {
 }
 
 void movc_execute1(cpu cpu) {
-	cpu->stage[alu1].result=cpu->stage[alu1].op1;
-	reportStage(cpu,alu1,"res=%d",cpu->stage[alu1].result);
-	exForward(cpu);
+	cpu->stage[alu1]->result=evalOpcode(MOVC,cpu->stage[alu1]->op1,0);
+	reportStage(cpu,alu1,ev_movc,0,cpu->stage[alu1]->result,0);
+	exForward(cpu,alu1);
 }
 
 void movc_execute3(cpu cpu) {
@@ -209,16 +202,14 @@ void movc_execute3(cpu cpu) {
 }
 
 void store_execute1(cpu cpu) {
-	cpu->stage[str1].effectiveAddr =
-		cpu->stage[str1].op1 + cpu->stage[str1].imm;
-	reportStage(cpu,str1,"effAddr=%08x",cpu->stage[str1].effectiveAddr);
+	cpu->stage[str1]->effectiveAddr =
+		cpu->stage[str1]->op1 + cpu->stage[str1]->imm;
+	reportStage(cpu,str1,ev_effAddr,0,cpu->stage[str1]->effectiveAddr,0);
 }
 
 void store_execute2(cpu cpu) {
-	dstore(cpu,cpu->stage[str2].effectiveAddr,cpu->stage[str2].op2);
-	reportStage(cpu,str2,"MEM[%06x]=%d",
-		cpu->stage[str2].effectiveAddr,
-		cpu->stage[str2].op1);
+	dstore(cpu,cpu->stage[str2]->effectiveAddr,cpu->stage[str2]->op2);
+	reportStage(cpu,str2,ev_store,0,cpu->stage[str2]->effectiveAddr,cpu->stage[str2]->op2);
 }
 
 void store_execute3(cpu cpu) {
@@ -226,17 +217,17 @@ void store_execute3(cpu cpu) {
 }
 
 void load_execute1(cpu cpu) {
-	cpu->stage[ldr1].effectiveAddr =
-		cpu->stage[ldr1].op1 + cpu->stage[ldr1].imm;
-	reportStage(cpu,ldr1,"effAddr=%08x",cpu->stage[ldr1].effectiveAddr);
+	cpu->stage[ldr1]->effectiveAddr =
+		cpu->stage[ldr1]->op1 + cpu->stage[ldr1]->imm;
+	reportStage(cpu,ldr1,ev_effAddr,0,cpu->stage[ldr1]->effectiveAddr,0);
 }
 
 void load_execute2(cpu cpu) {
-	cpu->stage[ldr2].result = dfetch(cpu,cpu->stage[ldr2].effectiveAddr);
-	reportStage(cpu,ldr2,"res=MEM[%06x]",cpu->stage[ldr2].effectiveAddr);
+	cpu->stage[ldr2]->result = dfetch(cpu,cpu->stage[ldr2]->effectiveAddr);
+	reportStage(cpu,ldr2,ev_load,0,cpu->stage[ldr2]->effectiveAddr,0);
 	assert(cpu->mem_fwdBus.valid==0); // load should not have used the ex forwarding bus
-	cpu->mem_fwdBus.tag=cpu->stage[ldr2].dr;
-	cpu->mem_fwdBus.value=cpu->stage[ldr2].result;
+	cpu->mem_fwdBus.tag=cpu->stage[ldr2]->dr;
+	cpu->mem_fwdBus.value=cpu->stage[ldr2]->result;
 	cpu->mem_fwdBus.valid=1;
 }
 
@@ -245,13 +236,13 @@ void load_execute3(cpu cpu) {
 }
 
 void cbranch_execute1(cpu cpu) {
-	if (cpu->stage[brz1].branch_taken) {
+	if (cpu->stage[brz1]->branch_taken) {
 		// Update PC
-		cpu->pc=cpu->stage[brz1].pc+cpu->stage[brz1].offset;
-		reportStage(cpu,brz1,"pc=%06x",cpu->pc);
+		cpu->pc=cpu->stage[brz1]->pc+cpu->stage[brz1]->offset;
+		reportStage(cpu,brz1,ev_newPC,0,cpu->pc,0);
 		cpu->halt_fetch=0; // Fetch can start again next cycle
 	} else {
-		reportStage(cpu,brz1,"No action... branch not taken");
+		reportStage(cpu,brz1,ev_noBranch,0,0,0);
 	}
 }
 
@@ -263,117 +254,173 @@ void cbranch_execute3(cpu cpu) {
   Writeback stage functions
 ---------------------------------------------------------*/
 void dest_writeback(cpu cpu) {
-	int reg=cpu->stage[writeback].dr;
-	cpu->reg[reg]=cpu->stage[writeback].result;
+	int reg=cpu->stage[writeback]->dr;
+	cpu->reg[reg]=cpu->stage[writeback]->result;
 	cpu->regValid[reg]=1;
-	reportStage(cpu,writeback,"R%02d<-%d",reg,cpu->stage[writeback].result);
+	reportStage(cpu,writeback,ev_regWrite,reg,cpu->stage[writeback]->result,0);
 }
 
 void halt_writeback(cpu cpu) {
 	cpu->stop=1;
+	cpu->halted=1;
 	strcpy(cpu->abend,"HALT instruction retired");
-	reportStage(cpu,writeback,"cpu stopped");
+	reportStage(cpu,writeback,ev_cpuStopped,0,0,0);
 }
 
 /*---------------------------------------------------------
   Externally available functions
 ---------------------------------------------------------*/
-void registerAllOpcodes() {
+void buildDefaultOps() {
+	registerAllOpcodes(&defaultOps);
+}
+
+const struct opTable_struct * defaultOpTable() {
+	pthread_once(&defaultOpsOnce,buildDefaultOps);
+	return &defaultOps;
+}
+
+void registerAllOpcodes(struct opTable_struct *tbl) {
+	memset(tbl,0,sizeof(*tbl));
 	// Invoke registerOpcode for EACH valid opcode here
-	registerOpcode(ADD,dss_decode,add_execute1,NULL,add_execute3,dest_writeback);
-	registerOpcode(ADDL,dsi_decode,add_execute1,NULL,add_execute3,dest_writeback);
-	registerOpcode(SUB,dss_decode,sub_execute1,NULL,sub_execute3,dest_writeback);
-	registerOpcode(SUBL,dsi_decode,sub_execute1,NULL,sub_execute3,dest_writeback);
-	registerOpcode(MUL,dss_decode,mul_execute1,NULL,mul_execute3,dest_writeback);
-	registerOpcode(AND,dss_decode,and_execute1,NULL,and_execute3,dest_writeback);
-	registerOpcode(OR,dss_decode,or_execute1,NULL,or_execute3,dest_writeback);
-	registerOpcode(XOR,dss_decode,xor_execute1,NULL,xor_execute3,dest_writeback);
-	registerOpcode(MOVC,movc_decode,movc_execute1,NULL,movc_execute3,dest_writeback);
-	registerOpcode(LOAD,dsi_decode,load_execute1,load_execute2,load_execute3,dest_writeback);
-	registerOpcode(STORE,ssi_decode,store_execute1,store_execute2,store_execute3,NULL);
-	registerOpcode(CMP,ssi_decode,cmp_execute1,NULL,cmp_execute3,NULL);
-	registerOpcode(JUMP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
-	registerOpcode(BZ,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
-	registerOpcode(BNZ,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
-	registerOpcode(BP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
-	registerOpcode(BNP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
-	registerOpcode(HALT,nop_decode,nop_execute1,nop_execute2,nop_execute3,halt_writeback);
-}
-
-void registerOpcode(int opNum,
+	registerOpcode(tbl,ADD,dss_decode,add_execute1,NULL,add_execute3,dest_writeback);
+	registerOpcode(tbl,ADDL,dsi_decode,add_execute1,NULL,add_execute3,dest_writeback);
+	registerOpcode(tbl,SUB,dss_decode,sub_execute1,NULL,sub_execute3,dest_writeback);
+	registerOpcode(tbl,SUBL,dsi_decode,sub_execute1,NULL,sub_execute3,dest_writeback);
+	registerOpcode(tbl,MUL,dss_decode,mul_execute1,NULL,mul_execute3,dest_writeback);
+	registerOpcode(tbl,AND,dss_decode,and_execute1,NULL,and_execute3,dest_writeback);
+	registerOpcode(tbl,OR,dss_decode,or_execute1,NULL,or_execute3,dest_writeback);
+	registerOpcode(tbl,XOR,dss_decode,xor_execute1,NULL,xor_execute3,dest_writeback);
+	registerOpcode(tbl,MOVC,movc_decode,movc_execute1,NULL,movc_execute3,dest_writeback);
+	registerOpcode(tbl,LOAD,dsi_decode,load_execute1,load_execute2,load_execute3,dest_writeback);
+	registerOpcode(tbl,STORE,ssi_decode,store_execute1,store_execute2,store_execute3,NULL);
+	registerOpcode(tbl,CMP,ssi_decode,cmp_execute1,NULL,cmp_execute3,NULL);
+	registerOpcode(tbl,JUMP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
+	registerOpcode(tbl,BZ,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
+	registerOpcode(tbl,BNZ,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
+	registerOpcode(tbl,BP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
+	registerOpcode(tbl,BNP,cbranch_decode,cbranch_execute1,NULL,cbranch_execute3,NULL);
+	registerOpcode(tbl,HALT,nop_decode,nop_execute1,nop_execute2,nop_execute3,halt_writeback);
+}
+
+void registerOpcode(struct opTable_struct *tbl,int opNum,
 	opStageFn decodeFn,opStageFn stg1,
 	opStageFn stg2,opStageFn stg3,opStageFn writebackFn) {
+	int s1=fuStage1(opcodeFU(opNum));
+	tbl->fns[decode][opNum] = decodeFn;
+	tbl->fns[s1][opNum] = stg1;
+	tbl->fns[s1+1][opNum] = stg2;
+	tbl->fns[s1+2][opNum] = stg3;
+	tbl->fns[writeback][opNum] = writebackFn;
+}
+
+int evalOpcode(int opNum,int op1,int op2) {
+	// Result computed by an ALU or MUL opcode - shared by all simulation engines
+	switch(opNum) {
+		case ADD:
+		case ADDL: return op1+op2;
+		case SUB:
+		case SUBL:
+		case CMP: return op1-op2;
+		case MUL: return op1*op2;
+		case AND: return op1&op2;
+		case OR: return op1|op2;
+		case XOR: return op1^op2;
+		case MOVC: return op1;
+		default: return 0;
+	}
+}
+
+int setsConditionCodes(int opNum) {
 	switch(opNum) {
+		case ADD:
+		case ADDL:
+		case SUB:
+		case SUBL:
 		case MUL:
-			opFns[decode][opNum] = decodeFn;
-			opFns[mul1][opNum] = stg1;
-			opFns[mul2][opNum] = stg2;
-			opFns[mul3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
-			break;
-		case STORE:
-			opFns[decode][opNum] = decodeFn;
-			opFns[str1][opNum] = stg1;
-			opFns[str2][opNum] = stg2;
-			opFns[str3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case CMP: return 1;
+		default: return 0;
+	}
+}
+
+int branchTaken(int opNum,struct CC_struct cc) {
+	switch(opNum) {
+		case JUMP: return 1;
+		case BZ: return cc.z;
+		case BNZ: return !cc.z;
+		case BP: return cc.p;
+		case BNP: return !cc.p;
+		default: return 0;
+	}
+}
+
+enum fu_enum opcodeFU(int opNum) {
+	switch(opNum) {
+		case MUL: return mul;
+		case LOAD: return ldr;
+		case STORE: return str;
+		case JUMP:
+		case BZ:
+		case BNZ:
+		case BP:
+		case BNP: return brz;
+		default: return alu;
+	}
+}
+
+int fuStage1(enum fu_enum fu) {
+	// Each functional unit has three stages, in fu_enum order starting at alu1
+	return alu1+3*fu;
+}
+
+void predecode(const struct opTable_struct *ops,int instruction,struct apexPredecode_struct *pd) {
+	memset(pd,0,sizeof(*pd));
+	pd->instruction=instruction;
+	pd->opcode=(instruction>>24);
+	if (pd->opcode<0 || pd->opcode>HALT) return; // Reported if it is ever fetched
+	pd->format=opInfo[pd->opcode].format;
+	switch(pd->format) {
+		case fmt_nop:
 			break;
-		case LOAD:
-			opFns[decode][opNum] = decodeFn;
-			opFns[ldr1][opNum] = stg1;
-			opFns[ldr2][opNum] = stg2;
-			opFns[ldr3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_dss:
+			pd->dr=(instruction&0x00f00000)>>20;
+			pd->sr1=(instruction&0x000f0000)>>16;
+			pd->sr2=(instruction&0x0000f000)>>12;
 			break;
-		case BZ:
-			opFns[decode][opNum] = decodeFn;
-			opFns[brz1][opNum] = stg1;
-			opFns[brz2][opNum] = stg2;
-			opFns[brz3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_dsi:
+			pd->dr=(instruction&0x00f00000)>>20;
+			pd->sr1=(instruction&0x000f0000)>>16;
+			pd->imm=((instruction&0x0000ffff)<<16)>>16; // Shift left/right to propagate sign bit
 			break;
-		case BNZ:
-			opFns[decode][opNum] = decodeFn;
-			opFns[brz1][opNum] = stg1;
-			opFns[brz2][opNum] = stg2;
-			opFns[brz3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_di:
+			pd->dr=(instruction&0x00f00000)>>20;
+			pd->imm=((instruction&0x0000ffff)<<16)>>16;
 			break;
-		case BP:
-			opFns[decode][opNum] = decodeFn;
-			opFns[brz1][opNum] = stg1;
-			opFns[brz2][opNum] = stg2;
-			opFns[brz3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_ssi:
+			pd->sr2=(instruction&0x00f00000)>>20;
+			pd->sr1=(instruction&0x000f0000)>>16;
+			pd->imm=((instruction&0x0000ffff)<<16)>>16;
 			break;
-		case BNP:
-			opFns[decode][opNum] = decodeFn;
-			opFns[brz1][opNum] = stg1;
-			opFns[brz2][opNum] = stg2;
-			opFns[brz3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_ss:
+			pd->sr1=(instruction&0x000f0000)>>16;
+			pd->sr2=(instruction&0x0000f000)>>12;
 			break;
-		case JUMP:
-			opFns[decode][opNum] = decodeFn;
-			opFns[brz1][opNum] = stg1;
-			opFns[brz2][opNum] = stg2;
-			opFns[brz3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
+		case fmt_off:
+			pd->offset=((instruction&0x00ffffff)<<8)>>8; // 24 bits, same as disassemble
 			break;
-		default:
-			opFns[decode][opNum] = decodeFn;
-			opFns[alu1][opNum] = stg1;
-			opFns[alu2][opNum] = stg2;
-			opFns[alu3][opNum] = stg3;
-			opFns[writeback][opNum] = writebackFn;
 	}
+	pd->func=opcodeFU(pd->opcode);
+	int s1=fuStage1(pd->func);
+	pd->fns[0]=ops->fns[decode][pd->opcode];
+	pd->fns[1]=ops->fns[s1][pd->opcode];
+	pd->fns[2]=ops->fns[s1+1][pd->opcode];
+	pd->fns[3]=ops->fns[s1+2][pd->opcode];
+	pd->fns[4]=ops->fns[writeback][pd->opcode];
 }
 
 char * disassemble(int instruction,char *buf) {
 	// assumes buf is big enough to hold the full disassemble string (max is probably 32)
 	int opcode=(instruction>>24);
 	if (opcode>HALT || opcode<0) {
-		printf("In disassemble, invalid opcode: %d\n",opcode);
 		strcpy(buf,"????");
 		return buf;
 	}
@@ -418,7 +465,6 @@ char * disassemble(int instruction,char *buf) {
 			sprintf(buf,"%s #%d",opInfo[opcode].mnemonic,offset);
 			break;
 		default :
-			printf("In disassemble, format not recognized: %d\n",fmt);
 			strcpy(buf,"????");
 	}
 	return buf;
@@ -428,74 +474,88 @@ char * disassemble(int instruction,char *buf) {
   Internal helper functions
 ---------------------------------------------------------*/
 void fetch_register1(cpu cpu) {
-	int reg=cpu->stage[decode].sr1;
+	int reg=cpu->stage[decode]->sr1;
 	// Check forwarding busses in program order
 	if (cpu->ex_fwdBus.valid && reg==cpu->ex_fwdBus.tag) {
-		cpu->stage[decode].op1=cpu->ex_fwdBus.value;
-		reportStage(cpu,decode," R%d=%d fwd from EX",reg,cpu->ex_fwdBus.value);
+		cpu->stage[decode]->op1=cpu->ex_fwdBus.value;
+		reportStage(cpu,decode,ev_regFwdEX,reg,cpu->ex_fwdBus.value,0);
 		return;
 	}
 	if (cpu->mem_fwdBus.valid && reg==cpu->mem_fwdBus.tag) {
-		cpu->stage[decode].op1=cpu->mem_fwdBus.value;
-		reportStage(cpu,decode," R%d=%d fwd from MEM",reg,cpu->mem_fwdBus.value);
+		cpu->stage[decode]->op1=cpu->mem_fwdBus.value;
+		reportStage(cpu,decode,ev_regFwdMEM,reg,cpu->mem_fwdBus.value,0);
 		return;
 	}
 	if (cpu->regValid[reg]) {
-		cpu->stage[decode].op1=cpu->reg[reg];
-		reportStage(cpu,decode," R%d=%d",reg,cpu->reg[reg]);
+		cpu->stage[decode]->op1=cpu->reg[reg];
+		reportStage(cpu,decode,ev_regRead,reg,cpu->reg[reg],0);
 		return;
 	}
 	// Register value cannot be found
-	cpu->stage[decode].status=stage_stalled;
-	reportStage(cpu,decode," R%d invalid",reg);
+	if (cpu->stage[decode]->status!=stage_stalled) { // the first source found missing is charged
+		cpu->perf.decodeStall=cpi_raw;
+		cpu->perf.decodeStallReg=reg;
+	}
+	setStatus(cpu,decode,stage_stalled);
+	reportStage(cpu,decode,ev_regInvalid,reg,0,0);
 	return;
 }
 
 void fetch_register2(cpu cpu) {
-	int reg=cpu->stage[decode].sr2;
+	int reg=cpu->stage[decode]->sr2;
 	// Check forwarding busses in program order
 	if (cpu->ex_fwdBus.valid && reg==cpu->ex_fwdBus.tag) {
-		cpu->stage[decode].op2=cpu->ex_fwdBus.value;
-		reportStage(cpu,decode," R%d=%d fwd from EX",reg,cpu->ex_fwdBus.value);
+		cpu->stage[decode]->op2=cpu->ex_fwdBus.value;
+		reportStage(cpu,decode,ev_regFwdEX,reg,cpu->ex_fwdBus.value,0);
 		return;
 	}
 	if (cpu->mem_fwdBus.valid && reg==cpu->mem_fwdBus.tag) {
-		cpu->stage[decode].op2=cpu->mem_fwdBus.value;
-		reportStage(cpu,decode," R%d=%d fwd from MEM",reg,cpu->mem_fwdBus.value);
+		cpu->stage[decode]->op2=cpu->mem_fwdBus.value;
+		reportStage(cpu,decode,ev_regFwdMEM,reg,cpu->mem_fwdBus.value,0);
 		return;
 	}
 	if (cpu->regValid[reg]) {
-		cpu->stage[decode].op2=cpu->reg[reg];
-		reportStage(cpu,decode," R%d=%d",reg,cpu->reg[reg]);
+		cpu->stage[decode]->op2=cpu->reg[reg];
+		reportStage(cpu,decode,ev_regRead,reg,cpu->reg[reg],0);
 		return;
 	}
 	// reg2 value cannot be found
-	cpu->stage[decode].status=stage_stalled;
-	reportStage(cpu,decode," R%d invalid",reg);
+	if (cpu->stage[decode]->status!=stage_stalled) { // the first source found missing is charged
+		cpu->perf.decodeStall=cpi_raw;
+		cpu->perf.decodeStallReg=reg;
+	}
+	setStatus(cpu,decode,stage_stalled);
+	reportStage(cpu,decode,ev_regInvalid,reg,0,0);
 }
 
 void check_dest(cpu cpu) {
-	int reg=cpu->stage[decode].dr;
+	int reg=cpu->stage[decode]->dr;
 	if (!cpu->regValid[reg]) {
-		cpu->stage[decode].status=stage_stalled;
-		reportStage(cpu,decode," R%d invalid",reg);
+		if (cpu->stage[decode]->status!=stage_stalled) { // RAW takes precedence
+			cpu->perf.decodeStall=cpi_waw;
+			cpu->perf.decodeStallReg=reg;
+		}
+		setStatus(cpu,decode,stage_stalled);
+		reportStage(cpu,decode,ev_regInvalid,reg,0,0);
 	}
-	if (cpu->stage[decode].status!=stage_stalled)  {
-		 cpu->regValid[cpu->stage[decode].dr]=0;
-		 reportStage(cpu,decode," invalidate R%d",reg);
+	if (cpu->stage[decode]->status!=stage_stalled)  {
+		 cpu->regValid[cpu->stage[decode]->dr]=0;
+		 reportStage(cpu,decode,ev_regInvalidate,reg,0,0);
 	}
 }
 
-void set_conditionCodes(cpu cpu) {
+void set_conditionCodes(cpu cpu,int stage) {
 	// Condition codes always set during the execute phase
-	if (cpu->stage[alu1].result==0) cpu->cc.z=1;
+	if (cpu->stage[stage]->result==0) cpu->cc.z=1;
 	else cpu->cc.z=0;
-	if (cpu->stage[alu1].result>0) cpu->cc.p=1;
+	if (cpu->stage[stage]->result>0) cpu->cc.p=1;
 	else cpu->cc.p=0;
+	cpu->stage[stage]->ccZ=cpu->cc.z; // for apexCheck
+	cpu->stage[stage]->ccP=cpu->cc.p;
 }
 
-void exForward(cpu cpu) {
-	cpu->ex_fwdBus.tag=cpu->stage[alu1].dr;
-	cpu->ex_fwdBus.value=cpu->stage[alu1].result;
+void exForward(cpu cpu,int stage) {
+	cpu->ex_fwdBus.tag=cpu->stage[stage]->dr;
+	cpu->ex_fwdBus.value=cpu->stage[stage]->result;
 	cpu->ex_fwdBus.valid=1;
 }
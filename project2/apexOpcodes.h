@@ -58,13 +58,29 @@ extern struct opInfo_struct {
 	enum opFormat_enum format;
 } opInfo[NUMOPS];
 
+/*---------------------------------------------------------
+  Dispatch table - a function pointer for each stage/opcode
+  		combination. Filled in by registerAllOpcodes, then
+  		read-only, so one table is shared by every cpu.
+---------------------------------------------------------*/
+struct opTable_struct {
+	opStageFn fns[18][NUMOPS];
+};
+
 /*---------------------------------------------------------
   Function declarations for externally available functions
 ---------------------------------------------------------*/
-void registerAllOpcodes();
-void registerOpcode(int opNum,
+const struct opTable_struct * defaultOpTable();
+void registerAllOpcodes(struct opTable_struct *tbl);
+void registerOpcode(struct opTable_struct *tbl,int opNum,
 	opStageFn decodeFn,opStageFn stg1,
 	opStageFn stg2,opStageFn stg3,opStageFn writebackFn);
+int evalOpcode(int opNum,int op1,int op2);
+int setsConditionCodes(int opNum);
+int branchTaken(int opNum,struct CC_struct cc);
+enum fu_enum opcodeFU(int opNum);
+int fuStage1(enum fu_enum fu);
+void predecode(const struct opTable_struct *ops,int instruction,struct apexPredecode_struct *pd);
 char * disassemble(int instruction,char *buf);
 
 #endif
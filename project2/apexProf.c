@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apexProf.h"
+#include "apexMem.h"
+
+/*---------------------------------------------------------
+This file reports where the cycles of a simulated program
+go, instruction by instruction.
+
+cycleCPU charges each cycle to an instruction with
+chargeCycle (see apexProf.h), only when cpu->profile is
+set. The counters are reported flat, hottest first, with
+the disassembly and the assembler source line kept by
+loadCPU, or as folded stacks (one "frame;frame;... count"
+line per instruction and cause) for flame graph tools.
+
+Only pipeline cycles are profiled. The functional engine
+does not advance the cycle count, so it is not charged.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+int profileTotal(const struct pcProfile_struct *p);
+int compareHot(const void *a,const void *b);
+
+struct hotSpot_struct {
+	int inum;
+	int cycles;
+};
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+void startProfile(cpu cpu) {
+	// Turns profiling on, or starts the counters over if it is already on
+	int size=cpu->numInstructions+1;
+	if (size!=cpu->profileSize) {
+		free(cpu->profile);
+		cpu->profile=malloc(size*sizeof(struct pcProfile_struct));
+		cpu->profileSize=size;
+	}
+	memset(cpu->profile,0,size*sizeof(struct pcProfile_struct));
+}
+
+void freeProfile(cpu cpu) {
+	// Turns profiling off, and frees the counters and the source lines
+	free(cpu->profile);
+	cpu->profile=NULL;
+	cpu->profileSize=0;
+	clearSource(cpu);
+	free(cpu->srcText);
+	cpu->srcText=NULL;
+	cpu->srcSize=0;
+}
+
+void printProfile(cpu cpu,int top) {
+	// Prints the top (all if top<=0) instructions by cycles charged
+	if (cpu->profile==NULL) {
+		cpuPrintf(cpu,"Profiling is off\n");
+		return;
+	}
+	int n=cpu->profileSize-1;
+	struct hotSpot_struct *hot=malloc((n+1)*sizeof(struct hotSpot_struct));
+	int nHot=0;
+	int total=0;
+	for(int i=0;i<n;i++) {
+		int cycles=profileTotal(&cpu->profile[i]);
+		if (cycles==0) continue;
+		hot[nHot].inum=i;
+		hot[nHot++].cycles=cycles;
+		total+=cycles;
+	}
+	const struct pcProfile_struct *none=&cpu->profile[n];
+	int noneCycles=profileTotal(none);
+	total+=noneCycles;
+	qsort(hot,nHot,sizeof(struct hotSpot_struct),compareHot);
+	if (top<=0 || top>nHot) top=nHot;
+
+	cpuPrintf(cpu,"Hot spots: %d cycles charged to %d instructions",total,nHot);
+	if (top<nHot) cpuPrintf(cpu,", hottest %d",top);
+	cpuPrintf(cpu,"\n");
+	if (nHot>0) cpuPrintf(cpu,"    inum    pc  cycles      %%  issued    RAW    WAW branch   HALT  instruction         source\n");
+	char disBuf[32],inumBuf[16];
+	for(int h=0;h<top;h++) {
+		const struct pcProfile_struct *p=&cpu->profile[hot[h].inum];
+		int instruction;
+		if (!peekCode(cpu,hot[h].inum,&instruction)) strcpy(disBuf,"????");
+		else disassemble(instruction,disBuf);
+		const char *src=(hot[h].inum<cpu->srcSize && cpu->srcText[hot[h].inum])?cpu->srcText[hot[h].inum]:"";
+		sprintf(inumBuf,"I%d",hot[h].inum);
+		cpuPrintf(cpu,"  %6s %05x %7d %5.1f%% %7d %6d %6d %6d %6d  %-19s %s\n",
+			inumBuf,0x4000+4*hot[h].inum,hot[h].cycles,100.0*hot[h].cycles/total,
+			p->cycles[cpi_issue],p->cycles[cpi_raw],p->cycles[cpi_waw],p->cycles[cpi_branch],p->cycles[cpi_halt],
+			disBuf,src);
+	}
+	if (noneCycles>0) {
+		cpuPrintf(cpu,"    %d cycles (%.1f%%) with no instruction to charge:",noneCycles,100.0*noneCycles/total);
+		for(int b=0;b<NUMCPI;b++) {
+			if (none->cycles[b]) cpuPrintf(cpu," %s %d",cpiName[b],none->cycles[b]);
+		}
+		cpuPrintf(cpu,"\n");
+	}
+	free(hot);
+}
+
+int writeFolded(cpu cpu,char * fileName,char * root) {
+	// Writes the profile as folded stacks: root;I<n> <disassembly>;<cause> <cycles>
+	//    Returns 0 if successful, -1 if the file could not be written
+	if (cpu->profile==NULL) {
+		cpuPrintf(cpu,"Profiling is off\n");
+		return -1;
+	}
+	FILE *f=fopen(fileName,"w");
+	if (f==NULL) {
+		cpuError(cpu,"Error - unable to open folded profile for write");
+		return -1;
+	}
+	char disBuf[32];
+	for(int i=0;i<cpu->profileSize;i++) {
+		const struct pcProfile_struct *p=&cpu->profile[i];
+		int instruction;
+		if (i==cpu->profileSize-1) strcpy(disBuf,"(no instruction)");
+		else if (!peekCode(cpu,i,&instruction)) strcpy(disBuf,"????");
+		else disassemble(instruction,disBuf);
+		for(int b=0;b<NUMCPI;b++) {
+			if (p->cycles[b]==0) continue;
+			if (i==cpu->profileSize-1) fprintf(f,"%s;%s;%s %d\n",root,disBuf,cpiName[b],p->cycles[b]);
+			else fprintf(f,"%s;I%d %s;%s %d\n",root,i,disBuf,cpiName[b],p->cycles[b]);
+		}
+	}
+	if (0!=fclose(f)) {
+		cpuError(cpu,"Error - writing folded profile");
+		return -1;
+	}
+	return 0;
+}
+
+void setSource(cpu cpu,int inum,const char *text) {
+	// Keeps a copy of the source line for instruction inum
+	if (inum>=cpu->srcSize) {
+		int size=cpu->srcSize?cpu->srcSize:64;
+		while(size<=inum) size*=2;
+		cpu->srcText=realloc(cpu->srcText,size*sizeof(char *));
+		memset(cpu->srcText+cpu->srcSize,0,(size-cpu->srcSize)*sizeof(char *));
+		cpu->srcSize=size;
+	}
+	while(*text==' ' || *text=='\t') text++;
+	free(cpu->srcText[inum]);
+	cpu->srcText[inum]=malloc(strlen(text)+1);
+	strcpy(cpu->srcText[inum],text);
+}
+
+void clearSource(cpu cpu) {
+	// Forgets the source lines... the array is kept for the next load
+	for(int i=0;i<cpu->srcSize;i++) {
+		free(cpu->srcText[i]);
+		cpu->srcText[i]=NULL;
+	}
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+int profileTotal(const struct pcProfile_struct *p) {
+	int total=0;
+	for(int b=0;b<NUMCPI;b++) total+=p->cycles[b];
+	return total;
+}
+
+int compareHot(const void *a,const void *b) {
+	// Most cycles first, then by instruction number
+	const struct hotSpot_struct *x=a,*y=b;
+	if (x->cycles!=y->cycles) return y->cycles-x->cycles;
+	return x->inum-y->inum;
+}
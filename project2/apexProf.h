@@ -0,0 +1,27 @@
+#ifndef APEXPROF_H // Guard against recursive includes
+#define APEXPROF_H
+#include <stdio.h>
+#include "apexCPU.h"
+
+/*---------------------------------------------------------
+  Hot spot profile - every pipeline cycle is charged to one
+  		instruction, by the same cpi_enum as the CPI stack.
+  		Issue and stall cycles go to the instruction in
+  		decode, bubbles go to the branch or HALT that caused
+  		them. Cycles with no instruction to blame (pipeline
+  		empty or draining) go to the last profile entry.
+---------------------------------------------------------*/
+static inline void chargeCycle(cpu cpu,int pc,int bucket) {
+	unsigned int i=(unsigned int)(pc-0x4000)/4;
+	if (pc<0x4000 || i>=(unsigned int)cpu->profileSize-1) i=cpu->profileSize-1;
+	cpu->profile[i].cycles[bucket]++;
+}
+
+void startProfile(cpu cpu);
+void freeProfile(cpu cpu);
+void printProfile(cpu cpu,int top);
+int writeFolded(cpu cpu,char * fileName,char * root);
+void setSource(cpu cpu,int inum,const char *text);
+void clearSource(cpu cpu);
+
+#endif
@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "apexServe.h"
+#include "apexCPU.h"
+#include "apexFunc.h"
+#include "apexMem.h"
+#include "apexObj.h"
+#include "apexProf.h"
+
+/*---------------------------------------------------------
+This file contains the simulation server, started by
+apexSim --serve. It keeps the simulator resident so a
+stream of small jobs pays no process startup or reload
+cost. The protocol is described in apexServe.h.
+
+The main thread accepts connections and queues them for a
+fixed pool of workers. A worker serves one connection at a
+time, request by request, with its own cpu. To stop, the
+main thread shuts down the connections being served, wakes
+the idle workers and joins them all before freeing the
+server.
+
+Loading a program is mostly predecoding its code, so the
+predecoded code pages are kept in a cache keyed by a hash
+of the object image. On a hit, the worker's cpu points at
+the cached code pages, which are read only while running,
+and only the data section is copied into memory. Entries
+in use by a worker are never evicted.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+  Data structures
+---------------------------------------------------------*/
+struct cacheEntry_struct {
+	uint64_t hash; // of the object image
+	void *obj; // copy of the object image, to rule out hash collisions
+	size_t size;
+	struct pageTable_struct codePages; // predecoded code, shared by the workers using it
+	int numInstructions;
+	int refs; // workers using the entry
+	long lastUse;
+};
+
+#define MAXPENDING 64 // accepted connections waiting for a worker
+
+struct server_struct {
+	pthread_mutex_t lock; // protects everything below
+	pthread_cond_t pending; // signalled when a connection is queued
+	pthread_cond_t room; // signalled when a worker takes a connection
+	int queue[MAXPENDING];
+	int head;
+	int tail;
+	struct cacheEntry_struct *cache;
+	int cacheSize;
+	int cacheUsed;
+	long useClock;
+	long requests;
+	long hits;
+	long misses;
+	// Settings
+	int maxCycles;
+	unsigned int memSize;
+	int listenFd;
+	volatile sig_atomic_t stopping; // set under the lock, except by stopServer
+	struct serveWorker_struct **workers;
+	int nworkers;
+};
+
+struct serveWorker_struct {
+	struct server_struct *srv;
+	pthread_t thread;
+	int fd; // connection being served, -1 if none (protected by srv->lock)
+	struct apexCPU_struct cpu;
+	char message[64]; // first line printed by the cpu, for load errors
+};
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void * serveWorker(void *arg);
+void serveConnection(struct serveWorker_struct *w,int fd);
+int runRequest(struct serveWorker_struct *w,const struct serveRequest_struct *req,const void *obj,
+	struct serveReply_struct *reply,int32_t **mem);
+struct cacheEntry_struct * cacheFind(struct server_struct *srv,uint64_t hash,const void *obj,size_t size);
+struct cacheEntry_struct * cacheInsert(struct server_struct *srv,cpu cpu,uint64_t hash,const void *obj,size_t size);
+void cacheRelease(struct server_struct *srv,struct cacheEntry_struct *e);
+uint64_t hashObject(const void *obj,size_t size);
+void captureOutput(void *ctx,const char *text);
+int readFull(int fd,void *buf,size_t len);
+int writeFull(int fd,const void *buf,size_t len);
+void stopWorkers(struct server_struct *srv);
+void freeServer(struct server_struct *srv);
+void stopServer(int sig);
+
+/*---------------------------------------------------------
+   Global Variables
+---------------------------------------------------------*/
+static struct server_struct *activeServer; // for stopServer
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+int serve(char *socketPath,int nworkers,int cacheSize,int maxCycles,unsigned int memSize) {
+	// Returns when a client sends serve_shutdown or on SIGINT/SIGTERM. Returns 0, or 1 if the socket failed
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if (strlen(socketPath)>=sizeof(addr.sun_path)) {
+		printf("Error - socket path %s is too long\n",socketPath);
+		return 1;
+	}
+	strcpy(addr.sun_path,socketPath);
+	int listenFd=socket(AF_UNIX,SOCK_STREAM,0);
+	if (listenFd<0) {
+		perror("Error - unable to create socket");
+		return 1;
+	}
+	unlink(socketPath); // left over from a server that did not shut down
+	if (0!=bind(listenFd,(struct sockaddr *)&addr,sizeof(addr)) || 0!=listen(listenFd,MAXPENDING)) {
+		perror("Error - unable to listen on socket");
+		close(listenFd);
+		return 1;
+	}
+
+	struct server_struct *srv=calloc(1,sizeof(struct server_struct));
+	pthread_mutex_init(&srv->lock,NULL);
+	pthread_cond_init(&srv->pending,NULL);
+	pthread_cond_init(&srv->room,NULL);
+	srv->cacheSize=cacheSize>0?cacheSize:0;
+	srv->cache=calloc(srv->cacheSize+1,sizeof(struct cacheEntry_struct));
+	srv->maxCycles=maxCycles;
+	srv->memSize=memSize;
+	srv->listenFd=listenFd;
+	activeServer=srv;
+
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=stopServer; // no SA_RESTART, so accept returns EINTR
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+	signal(SIGPIPE,SIG_IGN); // a client that goes away is a write error, not a signal
+
+	srv->nworkers=nworkers>0?nworkers:1;
+	srv->workers=malloc(srv->nworkers*sizeof(struct serveWorker_struct *));
+	for(int i=0;i<srv->nworkers;i++) {
+		struct serveWorker_struct *w=calloc(1,sizeof(struct serveWorker_struct));
+		w->srv=srv;
+		w->fd=-1;
+		srv->workers[i]=w;
+		pthread_create(&w->thread,NULL,serveWorker,w);
+	}
+	printf("Serving on %s with %d workers, predecode cache of %d programs\n",socketPath,srv->nworkers,srv->cacheSize);
+	fflush(stdout);
+
+	while(!srv->stopping) {
+		int fd=accept(listenFd,NULL,NULL);
+		if (fd<0) {
+			if (errno==EINTR || srv->stopping) continue;
+			perror("Error - accept failed");
+			break;
+		}
+		pthread_mutex_lock(&srv->lock);
+		while(srv->tail-srv->head==MAXPENDING) pthread_cond_wait(&srv->room,&srv->lock);
+		srv->queue[srv->tail++%MAXPENDING]=fd;
+		pthread_cond_signal(&srv->pending);
+		pthread_mutex_unlock(&srv->lock);
+	}
+
+	close(listenFd);
+	unlink(socketPath);
+	stopWorkers(srv);
+	signal(SIGINT,SIG_DFL);
+	signal(SIGTERM,SIG_DFL);
+	activeServer=NULL;
+	printf("Server stopped: %ld requests, %ld predecode cache hits, %ld misses\n",srv->requests,srv->hits,srv->misses);
+	freeServer(srv);
+	return 0;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void * serveWorker(void *arg) {
+	struct serveWorker_struct *w=arg;
+	struct server_struct *srv=w->srv;
+	for(;;) {
+		pthread_mutex_lock(&srv->lock);
+		while(srv->head==srv->tail && !srv->stopping) pthread_cond_wait(&srv->pending,&srv->lock);
+		if (srv->stopping) {
+			pthread_mutex_unlock(&srv->lock);
+			break;
+		}
+		int fd=srv->queue[srv->head++%MAXPENDING];
+		w->fd=fd;
+		pthread_cond_signal(&srv->room);
+		pthread_mutex_unlock(&srv->lock);
+		serveConnection(w,fd);
+		pthread_mutex_lock(&srv->lock);
+		w->fd=-1;
+		pthread_mutex_unlock(&srv->lock);
+		close(fd);
+	}
+	return NULL;
+}
+
+void stopWorkers(struct server_struct *srv) {
+	// Ends the connections being served, wakes the idle workers, and waits for them all
+	pthread_mutex_lock(&srv->lock);
+	srv->stopping=1;
+	for(int i=0;i<srv->nworkers;i++) {
+		if (srv->workers[i]->fd>=0) shutdown(srv->workers[i]->fd,SHUT_RDWR); // readFull returns 0
+	}
+	pthread_cond_broadcast(&srv->pending);
+	pthread_mutex_unlock(&srv->lock);
+	for(int i=0;i<srv->nworkers;i++) pthread_join(srv->workers[i]->thread,NULL);
+	// Connections accepted but never served
+	while(srv->head!=srv->tail) close(srv->queue[srv->head++%MAXPENDING]);
+}
+
+void freeServer(struct server_struct *srv) {
+	// Called once the workers have stopped
+	for(int i=0;i<srv->nworkers;i++) free(srv->workers[i]);
+	free(srv->workers);
+	for(int i=0;i<srv->cacheUsed;i++) {
+		freePages(&srv->cache[i].codePages);
+		free(srv->cache[i].obj);
+	}
+	free(srv->cache);
+	pthread_cond_destroy(&srv->room);
+	pthread_cond_destroy(&srv->pending);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+}
+
+void serveConnection(struct serveWorker_struct *w,int fd) {
+	// Answers requests until the client closes the connection or breaks the protocol
+	struct server_struct *srv=w->srv;
+	char *msg=NULL;
+	size_t msgSize=0;
+	int stopServing=0;
+	while(!stopServing) {
+		uint32_t len;
+		if (!readFull(fd,&len,sizeof(len))) break;
+		if (len<sizeof(struct serveRequest_struct) || len>SERVE_MAXMSG) break;
+		if (len>msgSize) {
+			free(msg);
+			msg=malloc(len);
+			msgSize=len;
+		}
+		if (!readFull(fd,msg,len)) break;
+		struct serveRequest_struct req;
+		memcpy(&req,msg,sizeof(req));
+
+		struct serveReply_struct reply;
+		memset(&reply,0,sizeof(reply));
+		int32_t *mem=NULL;
+		if (req.op==serve_run) {
+			if (req.objBytes!=len-sizeof(req) || req.memWords>SERVE_MAXMEMWORDS || req.memAddr%4) {
+				reply.status=serve_badRequest;
+				strcpy(reply.message,"object size, memAddr or memWords not valid");
+			} else {
+				runRequest(w,&req,msg+sizeof(req),&reply,&mem);
+			}
+		} else if (req.op==serve_stats) {
+			pthread_mutex_lock(&srv->lock);
+			snprintf(reply.message,sizeof(reply.message),"%ld requests, %ld hits, %ld misses, %d cached",
+				srv->requests,srv->hits,srv->misses,srv->cacheUsed);
+			pthread_mutex_unlock(&srv->lock);
+		} else if (req.op==serve_shutdown) {
+			strcpy(reply.message,"server stopping");
+			stopServing=1; // after the reply is written, as stopWorkers shuts down this connection
+		} else {
+			reply.status=serve_badRequest;
+			sprintf(reply.message,"unknown op %u",req.op);
+		}
+
+		len=sizeof(reply)+reply.memWords*sizeof(int32_t);
+		int ok=writeFull(fd,&len,sizeof(len)) && writeFull(fd,&reply,sizeof(reply))
+			&& writeFull(fd,mem,reply.memWords*sizeof(int32_t));
+		free(mem);
+		if (!ok) break;
+	}
+	if (stopServing) {
+		pthread_mutex_lock(&srv->lock);
+		srv->stopping=1;
+		pthread_mutex_unlock(&srv->lock);
+		shutdown(srv->listenFd,SHUT_RDWR); // wakes up accept
+	}
+	free(msg);
+}
+
+int runRequest(struct serveWorker_struct *w,const struct serveRequest_struct *req,const void *obj,
+	struct serveReply_struct *reply,int32_t **mem) {
+	// Loads (or finds in the cache) and runs one program. Returns 1 if it ran
+	struct server_struct *srv=w->srv;
+	cpu cpu=&w->cpu;
+	initCPU(cpu);
+	cpu->trace=0;
+	cpu->memSize=srv->memSize;
+	cpu->output=captureOutput;
+	cpu->outputCtx=w->message;
+	w->message[0]=0x00;
+
+	uint64_t hash=hashObject(obj,req->objBytes);
+	pthread_mutex_lock(&srv->lock);
+	srv->requests++;
+	struct cacheEntry_struct *e=cacheFind(srv,hash,obj,req->objBytes);
+	if (e) srv->hits++;
+	else srv->misses++;
+	pthread_mutex_unlock(&srv->lock);
+
+	int loaded;
+	if (e) {
+		// Same as loadBuffer, with the code already predecoded
+		const struct apexObjHeader_struct *hdr=e->obj;
+		const uint32_t *data=(const uint32_t *)(hdr+1)+hdr->codeWords;
+		cpu->codePages=e->codePages;
+		cpu->numInstructions=e->numInstructions;
+		for(int i=0;i<hdr->dataWords;i++) dstore(cpu,hdr->dataAddr+4*i,data[i]);
+		loaded=1;
+		reply->cached=1;
+	} else {
+		loaded=(loadBuffer(cpu,"request",obj,req->objBytes)>0);
+		if (loaded) e=cacheInsert(srv,cpu,hash,obj,req->objBytes);
+	}
+
+	if (loaded) {
+		int maxCycles=req->maxCycles?(int)req->maxCycles:srv->maxCycles;
+		// A program with no budget runs until the server stops
+		if (req->flags&serve_functional) {
+			while(!cpu->stop && !srv->stopping && (maxCycles<=0 || cpu->func_retired<maxCycles)) {
+				int chunk=(maxCycles<=0 || maxCycles-cpu->func_retired>65536)?65536:maxCycles-cpu->func_retired;
+				runFunctional(cpu,chunk);
+			}
+		}
+		else while(!cpu->stop && !srv->stopping && (maxCycles<=0 || cpu->t<maxCycles)) cycleCPU(cpu);
+		reply->status=serve_ok;
+		reply->cycles=cpu->t;
+		reply->retired=(req->flags&serve_functional)?cpu->func_retired:cpu->instr_retired;
+		reply->halted=cpu->halted;
+		reply->stop=cpu->stop;
+		memcpy(reply->reg,cpu->reg,sizeof(reply->reg));
+		reply->ccZ=cpu->cc.z;
+		reply->ccP=cpu->cc.p;
+		if (cpu->stop) strcpy(reply->message,cpu->abend);
+		if (req->memWords>0) {
+			*mem=calloc(req->memWords,sizeof(int32_t));
+			for(uint32_t i=0;i<req->memWords;i++) peekData(cpu,req->memAddr+4*i,&(*mem)[i]);
+			reply->memWords=req->memWords;
+		}
+	} else {
+		reply->status=serve_loadFailed;
+		strcpy(reply->message,w->message[0]?w->message:"load failed");
+	}
+
+	if (e) {
+		memset(&cpu->codePages,0,sizeof(cpu->codePages)); // the cache owns them
+		cpu->itlb.vpn=~0u;
+		cacheRelease(srv,e);
+	}
+	freeProfile(cpu);
+	freeMem(cpu);
+	return loaded;
+}
+
+struct cacheEntry_struct * cacheFind(struct server_struct *srv,uint64_t hash,const void *obj,size_t size) {
+	// Called with the lock held. Returns the entry for the object, in use, or NULL
+	for(int i=0;i<srv->cacheUsed;i++) {
+		struct cacheEntry_struct *e=&srv->cache[i];
+		if (e->hash!=hash || e->size!=size || 0!=memcmp(e->obj,obj,size)) continue;
+		e->refs++;
+		e->lastUse=++srv->useClock;
+		return e;
+	}
+	return NULL;
+}
+
+struct cacheEntry_struct * cacheInsert(struct server_struct *srv,cpu cpu,uint64_t hash,const void *obj,size_t size) {
+	// Hands the code pages just loaded into cpu to a new cache entry, in use.
+	//    Returns NULL if there is no room, or another worker cached the same object first
+	struct cacheEntry_struct *e=NULL;
+	pthread_mutex_lock(&srv->lock);
+	for(int i=0;i<srv->cacheUsed;i++) {
+		if (srv->cache[i].hash==hash && srv->cache[i].size==size && 0==memcmp(srv->cache[i].obj,obj,size)) {
+			pthread_mutex_unlock(&srv->lock);
+			return NULL;
+		}
+	}
+	if (srv->cacheUsed<srv->cacheSize) e=&srv->cache[srv->cacheUsed++];
+	else {
+		// Evict the least recently used entry that is not in use
+		for(int i=0;i<srv->cacheUsed;i++) {
+			struct cacheEntry_struct *c=&srv->cache[i];
+			if (c->refs==0 && (e==NULL || c->lastUse<e->lastUse)) e=c;
+		}
+		if (e) {
+			freePages(&e->codePages);
+			free(e->obj);
+		}
+	}
+	if (e) {
+		e->hash=hash;
+		e->obj=malloc(size);
+		memcpy(e->obj,obj,size);
+		e->size=size;
+		e->codePages=cpu->codePages;
+		e->numInstructions=cpu->numInstructions;
+		e->refs=1;
+		e->lastUse=++srv->useClock;
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return e;
+}
+
+void cacheRelease(struct server_struct *srv,struct cacheEntry_struct *e) {
+	pthread_mutex_lock(&srv->lock);
+	e->refs--;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+uint64_t hashObject(const void *obj,size_t size) {
+	// FNV-1a, a word at a time... objects are whole words
+	const uint32_t *w=obj;
+	uint64_t h=0xcbf29ce484222325ull;
+	for(size_t i=0;i<size/4;i++) h=(h^w[i])*0x100000001b3ull;
+	const unsigned char *b=obj;
+	for(size_t i=size&~(size_t)3;i<size;i++) h=(h^b[i])*0x100000001b3ull;
+	return h;
+}
+
+void captureOutput(void *ctx,const char *text) {
+	// Keeps the first line the cpu prints, without the newline
+	char *message=ctx;
+	if (message[0]) return;
+	snprintf(message,64,"%.*s",(int)strcspn(text,"\n"),text);
+}
+
+int readFull(int fd,void *buf,size_t len) {
+	// Returns 1 if len bytes were read, 0 at end of file or on an error
+	char *p=buf;
+	while(len>0) {
+		ssize_t n=read(fd,p,len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return 0;
+		p+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+int writeFull(int fd,const void *buf,size_t len) {
+	const char *p=buf;
+	while(len>0) {
+		ssize_t n=write(fd,p,len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return 0;
+		p+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+void stopServer(int sig) {
+	// No lock in a signal handler... stopWorkers sets stopping again under the lock before waking the workers
+	activeServer->stopping=1;
+	shutdown(activeServer->listenFd,SHUT_RDWR); // in case another thread took the signal
+}
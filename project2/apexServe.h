@@ -0,0 +1,63 @@
+#ifndef APEXSERVE_H // Guard against recursive includes
+#define APEXSERVE_H
+#include <stdint.h>
+
+/*---------------------------------------------------------
+  Simulation server protocol (apexSim --serve <socket>)
+
+  Clients connect to a Unix domain stream socket and send
+  any number of requests, each answered by one reply, in
+  order. Every message is a uint32_t byte count followed by
+  that many bytes. All fields are in host byte order, since
+  client and server are on the same machine.
+
+  Request: serveRequest_struct, then objBytes bytes of a
+  		binary object (apexAsm output).
+  Reply:   serveReply_struct, then memWords data words
+  		starting at memAddr (0 for words never written).
+---------------------------------------------------------*/
+#define SERVE_MAXMSG (64<<20) // larger messages close the connection
+#define SERVE_MAXMEMWORDS (1<<20)
+
+enum serveOp_enum {
+	serve_run=1, // load the object, run it, reply with the results
+	serve_stats, // reply message is the server's request and cache counters
+	serve_shutdown // stop accepting connections and exit
+};
+
+enum serveFlag_enum {
+	serve_functional=1 // use the functional engine, maxCycles limits instructions
+};
+
+enum serveStatus_enum {
+	serve_ok,
+	serve_loadFailed, // message says why
+	serve_badRequest
+};
+
+struct serveRequest_struct {
+	uint32_t op; // enum serveOp_enum
+	uint32_t flags; // enum serveFlag_enum bits
+	uint32_t maxCycles; // 0 for the server's --max-cycles
+	uint32_t memAddr; // first data word to return
+	uint32_t memWords; // number of data words to return
+	uint32_t objBytes; // size of the object that follows
+};
+
+struct serveReply_struct {
+	uint32_t status; // enum serveStatus_enum
+	uint32_t cached; // 1 if the program was already in the predecode cache
+	int32_t cycles;
+	int32_t retired;
+	int32_t halted;
+	int32_t stop;
+	int32_t reg[16];
+	int32_t ccZ;
+	int32_t ccP;
+	char message[64]; // stop reason, or why the request failed
+	uint32_t memWords; // number of data words that follow
+};
+
+int serve(char *socketPath,int nworkers,int cacheSize,int maxCycles,unsigned int memSize);
+
+#endif
@@ -1,33 +1,198 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 #include "apexCPU.h"
+#include "apexFunc.h"
+#include "apexMem.h"
+#include "apexSnap.h"
+#include "apexHist.h"
+#include "apexProf.h"
+#include "apexServe.h"
 
-void simCommands(cpu cpu);
+void simCommands(cpu cpu,int functional,struct history_struct *hist);
+void runCommand(cpu cpu,int functional,struct history_struct *hist,int verbose,int maxCycles,int untilRetired);
+void stepCPU(cpu cpu,int functional,struct history_struct *hist);
+char * cmdArg(char *cmd);
+int cmdIs(char *cmd,char *word);
+int runBatch(cpu cpu,int maxCycles,int functional);
+int runBatchSampled(cpu cpu,struct sample_struct *smp);
+void profileCommand(cpu cpu,char *arg);
+void setProgName(char *fileName);
+
+char progName[64]="apex"; // root frame of folded profiles, the object file name
 
 int main(int argc, char **argv) {
-	setbuf(stdout,0);
 	struct apexCPU_struct apexCPU;
+	int batch=0;
+	int functional=0; // use the functional engine instead of the pipeline
+	int maxCycles=0; // 0 means no cycle budget
+	unsigned int memSize=DEFAULT_MEMSIZE;
+	char *restoreFile=NULL;
+	int historyMB=64; // 0 turns off history for back and goto
+	int checkpointEvery=100;
+	struct sample_struct smp={0,20,0,0,0}; // window>0 turns sampling on
+	int profileTop=-1; // print the hottest profileTop instructions at the end, -1 for no profile
+	char *foldedFile=NULL;
+	char *socketPath=NULL; // --serve
+	int workers=sysconf(_SC_NPROCESSORS_ONLN);
+	int cacheSize=64;
 	int posArg=1;
-	if (argc>posArg) {
+	while (argc>posArg && (argv[posArg][0]=='-' || 0==strcmp(argv[posArg],"?"))) {
 		if (0==strcmp(argv[posArg],"-h") || 0==strcmp(argv[posArg],"?")) {
 			printf("APEX Simulator\n");
-			printf("Invoke as: %s [objectFileName]\n",argv[0]);
+			printf("Invoke as: %s [--batch] [--max-cycles <n>] [--functional] [--mem-size <bytes>] [objectFileName]\n",argv[0]);
 			printf("If [objectFileName] is specified, it will be loaded in the simulator.\n");
 			printf("Once started, the simulator will prompt for simulator commands with \"APEXSIM ==>\"\n");
 			printf("Enter the command \"help\" for information on simulator commands\n");
-			posArg++;
+			printf("With --batch, the object file is run without prompting or per-cycle output\n");
+			printf("   until HALT retires, the CPU stops, or <n> cycles (--max-cycles) have run.\n");
+			printf("   Exit code is 0 for HALT, 1 for abnormal stop, 2 if the cycle budget ran out.\n");
+			printf("With --functional, instructions are executed one at a time with no pipeline timing\n");
+			printf("   (--max-cycles then limits the number of instructions).\n");
+			printf("Sampling (implies --batch): --window <cycles> [--fast-forward <instructions>]\n");
+			printf("   [--warmup <cycles>] [--period <instructions>] [--samples <n>]\n");
+			printf("   executes <fast-forward> instructions functionally, then runs the pipeline for\n");
+			printf("   <warmup> cycles (default 20) and measures IPC over <window> cycles. With --period,\n");
+			printf("   repeats after executing <period> more instructions functionally.\n");
+			printf("--mem-size sets the size of the data address space (default %d bytes).\n",DEFAULT_MEMSIZE);
+			printf("--restore <snapshotFile> starts from a snapshot (see the save command) instead of\n");
+			printf("   an object file.\n");
+			printf("--history <MB> caps the memory kept for the back and goto commands (default 64, 0 for none)\n");
+			printf("   and --checkpoint <cycles> sets how often the state is saved (default 100).\n");
+			printf("--profile <n> charges every cycle to an instruction, and prints the <n> hottest\n");
+			printf("   instructions at the end (0 for all). --folded <file> writes the profile as folded\n");
+			printf("   stacks for flame graph tools.\n");
+			printf("--serve <socket> stays resident and runs the object images clients send over a Unix\n");
+			printf("   domain socket (see apexServe.h and apexClient), on --workers <n> threads (default\n");
+			printf("   one per processor), keeping the --cache <n> (default 64) most recent programs\n");
+			printf("   predecoded. --max-cycles and --mem-size apply to every request.\n");
+		} else if (0==strcmp(argv[posArg],"--serve") && argc>posArg+1) {
+			socketPath=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"--workers") && argc>posArg+1) {
+			workers=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--cache") && argc>posArg+1) {
+			cacheSize=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--batch")) {
+			batch=1;
+		} else if (0==strcmp(argv[posArg],"--functional")) {
+			functional=1;
+		} else if (0==strcmp(argv[posArg],"--max-cycles") && argc>posArg+1) {
+			maxCycles=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--mem-size") && argc>posArg+1) {
+			memSize=strtoul(argv[++posArg],NULL,0)&~3u;
+		} else if (0==strcmp(argv[posArg],"--history") && argc>posArg+1) {
+			historyMB=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--checkpoint") && argc>posArg+1) {
+			checkpointEvery=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--profile") && argc>posArg+1) {
+			profileTop=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--folded") && argc>posArg+1) {
+			foldedFile=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"--restore") && argc>posArg+1) {
+			restoreFile=argv[++posArg];
+		} else if (0==strcmp(argv[posArg],"--fast-forward") && argc>posArg+1) {
+			smp.fastForward=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--warmup") && argc>posArg+1) {
+			smp.warmup=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--window") && argc>posArg+1) {
+			smp.window=atoi(argv[++posArg]);
+			batch=1;
+		} else if (0==strcmp(argv[posArg],"--period") && argc>posArg+1) {
+			smp.period=atoi(argv[++posArg]);
+		} else if (0==strcmp(argv[posArg],"--samples") && argc>posArg+1) {
+			smp.maxSamples=atoi(argv[++posArg]);
+		} else {
+			printf("Unrecognized option: %s. Use -h for help.\n",argv[posArg]);
+			return 1;
 		}
+		posArg++;
 	}
+	if (socketPath) return serve(socketPath,workers,cacheSize,maxCycles,memSize);
 
 	initCPU(&apexCPU);
-	if (argc>posArg) loadCPU(&apexCPU,argv[posArg]);
-	simCommands(&apexCPU);
+	apexCPU.memSize=memSize;
+	if (restoreFile) setProgName(restoreFile);
+	else if (argc>posArg) setProgName(argv[posArg]);
+	if (batch) {
+		if (argc<=posArg && restoreFile==NULL) {
+			printf("Error - --batch requires an object file name\n");
+			return 1;
+		}
+		apexCPU.trace=0;
+		int rc=1;
+		int loaded;
+		if (restoreFile) loaded=(0==loadSnapshot(&apexCPU,restoreFile));
+		else loaded=(loadCPU(&apexCPU,argv[posArg])>0);
+		if (loaded) {
+			if (profileTop>=0 || foldedFile) startProfile(&apexCPU);
+			if (smp.window>0) rc=runBatchSampled(&apexCPU,&smp);
+			else rc=runBatch(&apexCPU,maxCycles,functional);
+			if (profileTop>=0) printProfile(&apexCPU,profileTop);
+			if (foldedFile) writeFolded(&apexCPU,foldedFile,progName);
+		}
+		freeProfile(&apexCPU);
+		freeMem(&apexCPU);
+		return rc;
+	}
+
+	setbuf(stdout,0);
+	if (restoreFile) loadSnapshot(&apexCPU,restoreFile);
+	else if (argc>posArg) loadCPU(&apexCPU,argv[posArg]);
+	if (profileTop>=0 || foldedFile) startProfile(&apexCPU);
+	struct history_struct hist;
+	memset(&hist,0,sizeof(hist));
+	if (historyMB>0) enableHistory(&apexCPU,&hist,checkpointEvery,((size_t)historyMB)<<20);
+	simCommands(&apexCPU,functional,&hist);
+	disableHistory(&apexCPU,&hist);
 	printStats(&apexCPU);
+	if (profileTop>=0) printProfile(&apexCPU,profileTop);
+	if (foldedFile) writeFolded(&apexCPU,foldedFile,progName);
+	freeProfile(&apexCPU);
+	freeMem(&apexCPU);
 	return 0;
 }
 
-void simCommands(cpu cpu) {
+/*---------------------------------------------------------
+  runBatch: cycles the CPU with no per-cycle output until
+  		it stops or maxCycles (if >0) cycles have run.
+  		If functional, executes instructions instead of cycles.
+  		Prints the statistics, and returns the exit code
+---------------------------------------------------------*/
+int runBatch(cpu cpu,int maxCycles,int functional) {
+	clock_t start=clock();
+	if (functional) runFunctional(cpu,maxCycles);
+	else while(!cpu->stop && (maxCycles<=0 || cpu->t<maxCycles)) cycleCPU(cpu);
+	double secs=((double)(clock()-start))/CLOCKS_PER_SEC;
+	printStats(cpu);
+	if (secs>0) {
+		if (functional) printf("    Simulation rate: %.0f instructions/second\n",cpu->func_retired/secs);
+		else printf("    Simulation rate: %.0f cycles/second\n",cpu->t/secs);
+	}
+#ifdef APEX_HOSTSTATS
+	if (!functional) printHostStats(cpu);
+#endif
+	if (cpu->halted) return 0;
+	if (cpu->stop) return 1;
+	printf("    Budget of %d %s exhausted\n",maxCycles,functional?"instructions":"cycles");
+	return 2;
+}
+
+/*---------------------------------------------------------
+  runBatchSampled: runs the CPU in sampling mode, and
+  		prints the statistics and the sampled IPC estimate
+---------------------------------------------------------*/
+int runBatchSampled(cpu cpu,struct sample_struct *smp) {
+	runSampled(cpu,smp);
+	printStats(cpu);
+	printSampleStats(cpu,smp);
+	if (cpu->halted || !cpu->stop) return 0;
+	return 1;
+}
+
+void simCommands(cpu cpu,int functional,struct history_struct *hist) {
 	// prompt and execute APEX CPU simulation commands
 	char cmdBuf[128],prevCmd[128];
 	int verbose=0;
@@ -69,44 +234,253 @@ void simCommands(cpu cpu) {
 				}
 				while(isspace((int)bufPtr[0])) bufPtr++; // Skip spaces after load
 				loadCPU(cpu,bufPtr);
+				setProgName(bufPtr);
+				resetHistory(hist);
 				continue;
 			case 'h':
+				if (cmdIs(bufPtr,"hoststats")) {
+					if (cmdIs(cmdArg(bufPtr),"reset")) resetHostStats(cpu);
+					else printHostStats(cpu);
+					continue;
+				}
+				// fall through
 			case '?':
 				printf("\n  APEX simulation commands...\n");
 				printf("      quit - to exit simulation\n");
 				printf("      help or ? - to print this help\n");
 				printf("      load <objfilename> - to load the object file into memory and reset simulation\n");
-				printf("      cycle - to simulate a single cycle\n");
-				printf("      run - to repeat cycles until HALT is retired or abnormal termination\n");
+				printf("      cycle - to simulate a single cycle (or instruction when functional)\n");
+				printf("      run [n] - to repeat cycles until HALT is retired, abnormal termination,\n");
+				printf("            a breakpoint or watchpoint, or n cycles (instructions when functional)\n");
+				printf("      until retired=<n> - to run until <n> instructions have retired\n");
+				printf("      break <pc|I<n>> - to set or clear a breakpoint, stopping run before pc is fetched\n");
+				printf("            (pc in hex, or an instruction number). With no argument, lists breakpoints\n");
+				printf("      watch <addr> - to set or clear a watchpoint, stopping run after addr (hex) is\n");
+				printf("            stored. With no argument, lists watchpoints\n");
 				printf("      verbose - toggle automatic invocation of  \"state\" after each cycle (starts off)\n");
+				printf("      functional - toggle between the pipeline and the functional (ISA level) engine (starts %s)\n",
+					functional?"on":"off");
+				printf("      back [n] - to go back n cycles (default 1)\n");
+				printf("      goto t=<n> - to go to cycle n, back or forward\n");
 				printf("      state - to print current state of APEX registers\n");
+				printf("      stats - to print the performance counters (CPI stack, stalls, FU utilization)\n");
+				printf("      profile [n] - to print the n (default 10, 0 for all) instructions charged the most\n");
+				printf("            cycles, turning profiling on if it is off. \"profile reset\" starts over,\n");
+				printf("            \"profile off\" stops, and \"profile folded <file>\" writes folded stacks\n");
+				printf("      hoststats [reset] - to print the simulator's own time per simulated cycle, by section\n");
+				printf("            (needs a build with make HOSTSTATS=1)\n");
+				printf("      save <file> - to save a snapshot of the complete simulation state\n");
+				printf("      restore <file> - to restore the simulation state from a snapshot\n");
 				printf("      <empty> - repeat previous command\n");
-				printf("All commands can be abbreviated to one letter.\n");
+				printf("All commands except save, restore, back, stats and hoststats can be abbreviated to one letter.\n");
 				continue;
 			case 's':
+				if (cmdIs(bufPtr,"stats")) {
+					printf("Performance counters at cycle %d, %d instructions retired:\n",cpu->t,cpu->instr_retired);
+					printPerf(cpu);
+					continue;
+				}
+				if (cmdIs(bufPtr,"save")) {
+					if (0==saveSnapshot(cpu,cmdArg(bufPtr))) printf("Saved snapshot at cycle %d\n",cpu->t);
+					continue;
+				}
 				printState(cpu);
 				continue;
 			case 'v':
 				verbose=!verbose;
 				continue;
+			case 'f':
+				if (!functional && !pipelineEmpty(cpu)) {
+					printf("Draining the pipeline before switching to the functional engine\n");
+					drainPipeline(cpu);
+				}
+				functional=!functional;
+				resetHistory(hist);
+				printf("Using the %s engine\n",functional?"functional":"pipeline");
+				continue;
 			case 'c':
-				cycleCPU(cpu);
+				stepCPU(cpu,functional,hist);
 				if (verbose) printState(cpu);
 				continue;
-			case 'r': {
-				int maxCycles=20;
-				while((cpu->stop==0) & (maxCycles>0)) {
-					cycleCPU(cpu);
+			case 'r':
+				if (cmdIs(bufPtr,"restore")) {
+					clearSource(cpu); // snapshots have no source lines
+					if (0==loadSnapshot(cpu,cmdArg(bufPtr))) printf("Restored snapshot at cycle %d\n",cpu->t);
+					resetHistory(hist);
+					continue;
+				}
+				runCommand(cpu,functional,hist,verbose,atoi(cmdArg(bufPtr)),0);
+				continue;
+			case 'u': {
+				int retired;
+				if (1!=sscanf(cmdArg(bufPtr),"retired=%d",&retired)) {
+					printf("expected until retired=<n>. Got %s\n",cmdBuf);
+					continue;
+				}
+				runCommand(cpu,functional,hist,verbose,0,retired);
+				continue;
+			}
+			case 'g':
+			case 'b': {
+				char *arg=cmdArg(bufPtr);
+				if (bufPtr[0]=='g' || cmdIs(bufPtr,"back")) {
+					int t;
+					if (bufPtr[0]=='b') t=cpu->t-(arg[0]?atoi(arg):1);
+					else if (1!=sscanf(arg,"t=%d",&t)) {
+						printf("expected goto t=<n>. Got %s\n",cmdBuf);
+						continue;
+					}
+					if (functional || hist->log.d==NULL) {
+						printf("Going back needs the pipeline engine and history (see --history)\n");
+						continue;
+					}
+					if (t<0) t=0;
+					int from=cpu->t;
+					if (0!=travelTo(cpu,hist,t)) {
+						printf("Cycle %d is no longer in the history, the oldest is %d\n",t,oldestHistory(hist));
+						continue;
+					}
+					printf("Now at cycle %d\n",cpu->t);
+					if (cpu->profile && cpu->t<from) {
+						startProfile(cpu); // The cycles gone back over would be charged twice
+						printf("Profiling from cycle %d\n",cpu->t);
+					}
 					if (verbose) printState(cpu);
-					maxCycles--;
+					continue;
+				}
+				if (arg[0]==0x00) {
+					listBreaks(cpu);
+					continue;
 				}
-				if (maxCycles<=0) {
-					printf("... stopped after 20 cycles... use \"run\" again to continue\n");
+				int inum;
+				if (toupper(arg[0])=='I') inum=atoi(arg+1);
+				else inum=(strtol(arg,NULL,16)-0x4000)/4;
+				int set=toggleBreak(cpu,inum);
+				if (set<0) printf("No instruction at %s\n",arg);
+				else printf("Breakpoint at I%d (pc=%05x) %s\n",inum,0x4000+4*inum,set?"set":"cleared");
+				continue;
+			}
+			case 'p':
+				profileCommand(cpu,cmdArg(bufPtr));
+				continue;
+			case 'w': {
+				char *arg=cmdArg(bufPtr);
+				if (arg[0]==0x00) {
+					listWatches(cpu);
+					continue;
 				}
+				int addr=strtol(arg,NULL,16);
+				int set=toggleWatch(cpu,addr);
+				if (set<0) printf("Invalid data address %s\n",arg);
+				else printf("Watchpoint on MEM[%04x] %s\n",addr,set?"set":"cleared");
 				continue;
 			}
 			default:
 				printf("Unrecognized APEX simulation command: %s\n",cmdBuf);
 		}
 	}
+}
+
+/*---------------------------------------------------------
+  runCommand: cycles the CPU (or steps it when functional)
+  		until it stops, maxCycles (if >0) have run, a
+  		watched word is stored, the pc moves to a breakpoint,
+  		or untilRetired (if >0) instructions have retired.
+  		While fetch is stalled the pc stays put, and that is
+  		not a new visit to the breakpoint.
+---------------------------------------------------------*/
+void runCommand(cpu cpu,int functional,struct history_struct *hist,int verbose,int maxCycles,int untilRetired) {
+	int n=0;
+	cpu->watchHit=0;
+	while(!cpu->stop) {
+		if (maxCycles>0 && n>=maxCycles) {
+			printf("... stopped after %d %s... use \"run\" again to continue\n",n,functional?"instructions":"cycles");
+			return;
+		}
+		int pcBefore=cpu->pc;
+		stepCPU(cpu,functional,hist);
+		if (verbose) printState(cpu);
+		n++;
+		if (cpu->watchHit) {
+			int value=0;
+			peekData(cpu,cpu->watchAddr,&value);
+			printf("... stopped at watchpoint, MEM[%04x]=%d\n",cpu->watchAddr,value);
+			return;
+		}
+		if ((functional || cpu->pc!=pcBefore) && isBreak(cpu,cpu->pc)) { // a functional step always executes one
+			printf("... stopped at breakpoint, I%d (pc=%05x) is next\n",(cpu->pc-0x4000)/4,cpu->pc);
+			return;
+		}
+		if (untilRetired>0 && cpu->instr_retired+cpu->func_retired>=untilRetired) {
+			printf("... stopped after %d instructions retired\n",cpu->instr_retired+cpu->func_retired);
+			return;
+		}
+	}
+}
+
+/*---------------------------------------------------------
+  profileCommand: profile [n|reset|off|folded <file>]
+---------------------------------------------------------*/
+void profileCommand(cpu cpu,char *arg) {
+	if (cmdIs(arg,"off")) {
+		free(cpu->profile);
+		cpu->profile=NULL;
+		cpu->profileSize=0;
+		printf("Profiling is off\n");
+		return;
+	}
+	if (cpu->profile==NULL || cmdIs(arg,"reset")) {
+		startProfile(cpu);
+		printf("Profiling from cycle %d\n",cpu->t);
+		return;
+	}
+	if (cmdIs(arg,"folded")) {
+		if (0==writeFolded(cpu,cmdArg(arg),progName)) printf("Wrote folded profile to %s\n",cmdArg(arg));
+		return;
+	}
+	printProfile(cpu,arg[0]?atoi(arg):10);
+}
+
+/*---------------------------------------------------------
+  setProgName: sets progName to the file name without its
+  		directory and extension
+---------------------------------------------------------*/
+void setProgName(char *fileName) {
+	char *base=strrchr(fileName,'/');
+	base=base?base+1:fileName;
+	snprintf(progName,sizeof(progName),"%s",base);
+	char *dot=strrchr(progName,'.');
+	if (dot && dot!=progName) *dot=0x00;
+}
+
+/*---------------------------------------------------------
+  stepCPU: one cycle, or one instruction when functional,
+  		keeping the history for back and goto up to date
+---------------------------------------------------------*/
+void stepCPU(cpu cpu,int functional,struct history_struct *hist) {
+	if (functional) {
+		resetHistory(hist); // History only follows the pipeline
+		stepFunctional(cpu);
+	} else {
+		recordHistory(cpu,hist);
+		cycleCPU(cpu);
+	}
+}
+
+/*---------------------------------------------------------
+  cmdArg: returns the argument after the command word
+  		(an empty string if there is none)
+---------------------------------------------------------*/
+char * cmdArg(char *cmd) {
+	while(cmd[0]!=0x00 && !isspace((int)cmd[0])) cmd++;
+	while(isspace((int)cmd[0])) cmd++;
+	return cmd;
+}
+
+/*---------------------------------------------------------
+  cmdIs: returns 1 if the command word is exactly word
+---------------------------------------------------------*/
+int cmdIs(char *cmd,char *word) {
+	int wl=strlen(word);
+	return 0==strncmp(cmd,word,wl) && (cmd[wl]==0x00 || isspace((int)cmd[wl]));
 }
\ No newline at end of file
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "apexSnap.h"
+#include "apexMem.h"
+
+/*---------------------------------------------------------
+This file saves and restores the complete CPU state.
+
+A snapshot is:
+	header (see apexSnap.h)
+	core        - apexCPU_struct up to codePages, with pointers zeroed
+	code        - numInstructions instruction words
+	data pages  - dataPages of: page number, words, written bitmap
+	              (code and data are left out with SNAP_NOMEMORY)
+	uninit      - total, n, then uninitSlots hash table slots
+
+Pointers in the core are rebuilt on restore: stage latches
+from the latch indexes in the header, and the predecoded
+instruction of each latch from its pc. The layout of the core
+depends on the compiler, so coreBytes must match the build.
+---------------------------------------------------------*/
+
+/*---------------------------------------------------------
+   Internal function declarations
+---------------------------------------------------------*/
+void * snapAppend(struct snapshot_struct *snap,const void *data,size_t len);
+const void * snapTake(const char **pos,const char *end,size_t len);
+
+/*---------------------------------------------------------
+   External Function definitions
+---------------------------------------------------------*/
+int takeSnapshot(cpu cpu,struct snapshot_struct *snap,int flags) {
+	// Replaces the contents of snap with the state of the cpu. Returns 0 if successful
+	const size_t coreBytes=offsetof(struct apexCPU_struct,codePages);
+	struct snapHeader_struct hdr;
+	memset(&hdr,0,sizeof(hdr));
+	hdr.magic=APEXSNAP_MAGIC;
+	hdr.version=APEXSNAP_VERSION;
+	hdr.coreBytes=coreBytes;
+	hdr.numInstructions=(flags&SNAP_NOMEMORY)?0:cpu->numInstructions;
+	hdr.uninitSlots=cpu->uninit.size;
+	hdr.flags=flags;
+	for(int s=0;s<18;s++) {
+		hdr.stageLatch[s]=cpu->stage[s]-cpu->latch;
+		hdr.hasPd[s]=cpu->latch[s].pd!=NULL;
+	}
+	for(int d=0;d<DIRSIZE && !(flags&SNAP_NOMEMORY);d++) {
+		if (cpu->dataPages.dir[d]==NULL) continue;
+		for(int p=0;p<DIRSIZE;p++) if (cpu->dataPages.dir[d][p]) hdr.dataPages++;
+	}
+
+	snap->len=0;
+	if (NULL==snapAppend(snap,&hdr,sizeof(hdr))) return -1;
+	struct apexCPU_struct *core=snapAppend(snap,cpu,coreBytes);
+	if (core==NULL) return -1;
+	for(int s=0;s<18;s++) {
+		core->stage[s]=NULL;
+		core->latch[s].pd=NULL;
+	}
+	core->itlb.page=core->dtlb.page=NULL;
+	core->ops=NULL;
+
+	uint32_t *code=snapAppend(snap,NULL,4*(size_t)hdr.numInstructions);
+	if (code==NULL) return -1;
+	for(int i=0;i<(int)hdr.numInstructions;i++) {
+		struct codePage_struct *page=cpu->codePages.dir[(i/PAGEWORDS)/DIRSIZE][(i/PAGEWORDS)%DIRSIZE];
+		code[i]=page->pd[i%PAGEWORDS].instruction;
+	}
+
+	for(int d=0;d<DIRSIZE && !(flags&SNAP_NOMEMORY);d++) {
+		if (cpu->dataPages.dir[d]==NULL) continue;
+		for(int p=0;p<DIRSIZE;p++) {
+			struct dataPage_struct *page=cpu->dataPages.dir[d][p];
+			if (page==NULL) continue;
+			uint32_t vpn=d*DIRSIZE+p;
+			if (NULL==snapAppend(snap,&vpn,sizeof(vpn))) return -1;
+			if (NULL==snapAppend(snap,page->word,sizeof(page->word))) return -1;
+			if (NULL==snapAppend(snap,page->written,sizeof(page->written))) return -1;
+		}
+	}
+
+	int counts[2]={cpu->uninit.total,cpu->uninit.n};
+	if (NULL==snapAppend(snap,counts,sizeof(counts))) return -1;
+	if (NULL==snapAppend(snap,cpu->uninit.tbl,cpu->uninit.size*sizeof(struct uninitRead_struct))) return -1;
+	return 0;
+}
+
+int restoreSnapshot(cpu cpu,const void *data,size_t len) {
+	// Restores the cpu from a snapshot. Returns 0 if successful, or -1 (and leaves
+	//    the cpu unchanged) if the snapshot is not valid for this build
+	const char *pos=data,*end=pos+len;
+	const struct snapHeader_struct *hdr=snapTake(&pos,end,sizeof(*hdr));
+	if (hdr==NULL || hdr->magic!=APEXSNAP_MAGIC) {
+		printf("Restore aborted, not an APEX snapshot\n");
+		return -1;
+	}
+	if (hdr->version!=APEXSNAP_VERSION) {
+		printf("Restore aborted, snapshot version is %u, this simulator needs version %u\n",hdr->version,APEXSNAP_VERSION);
+		return -1;
+	}
+	if (hdr->coreBytes!=offsetof(struct apexCPU_struct,codePages)) {
+		printf("Restore aborted, the snapshot has %u bytes of cpu state, this simulator needs %zu... "
+			"it was saved by a build with a different apexCPU_struct layout\n",
+			hdr->coreBytes,offsetof(struct apexCPU_struct,codePages));
+		return -1;
+	}
+	size_t pageBytes=sizeof(uint32_t)+sizeof(((struct dataPage_struct *)0)->word)+sizeof(((struct dataPage_struct *)0)->written);
+	size_t need=sizeof(*hdr)+hdr->coreBytes+4*(size_t)hdr->numInstructions+hdr->dataPages*pageBytes
+		+2*sizeof(int)+hdr->uninitSlots*sizeof(struct uninitRead_struct);
+	if (need!=len || (hdr->uninitSlots&(hdr->uninitSlots-1))) {
+		printf("Restore aborted, snapshot is truncated or corrupt\n");
+		return -1;
+	}
+	for(int s=0;s<18;s++) if (hdr->stageLatch[s]>=18) {
+		printf("Restore aborted, snapshot is truncated or corrupt\n");
+		return -1;
+	}
+
+	// Core state, keeping the settings of this cpu
+	int trace=cpu->trace;
+	const struct opTable_struct *ops=cpu->ops;
+	memcpy(cpu,snapTake(&pos,end,hdr->coreBytes),hdr->coreBytes);
+	cpu->trace=trace;
+	cpu->ops=ops;
+	cpu->itlb.vpn=cpu->dtlb.vpn=~0u;
+	cpu->itlb.page=cpu->dtlb.page=NULL;
+	cpu->watchHit=0;
+
+	// Code, only predecoded again if it changed
+	const uint32_t *code=snapTake(&pos,end,4*(size_t)hdr->numInstructions);
+	for(int i=0;i<(int)hdr->numInstructions;i++) {
+		struct codePage_struct *page=NULL;
+		void **dir=cpu->codePages.dir[(i/PAGEWORDS)/DIRSIZE];
+		if (dir) page=dir[(i/PAGEWORDS)%DIRSIZE];
+		if (page==NULL || page->pd[i%PAGEWORDS].instruction!=(int)code[i]) storeCode(cpu,i,code[i]);
+	}
+	for(int s=0;s<18;s++) {
+		cpu->stage[s]=&cpu->latch[hdr->stageLatch[s]];
+		cpu->latch[s].pd=NULL; // stays NULL if the latch pc is not in the restored program
+		if (hdr->hasPd[s]) cpu->latch[s].pd=peekDecoded(cpu,cpu->latch[s].pc);
+	}
+
+	// Data pages... existing pages are cleared but kept, so watchpoints stay set
+	for(int d=0;d<DIRSIZE && !(hdr->flags&SNAP_NOMEMORY);d++) {
+		if (cpu->dataPages.dir[d]==NULL) continue;
+		for(int p=0;p<DIRSIZE;p++) {
+			struct dataPage_struct *page=cpu->dataPages.dir[d][p];
+			if (page==NULL) continue;
+			memset(page->word,0,sizeof(page->word));
+			memset(page->written,0,sizeof(page->written));
+		}
+	}
+	for(int i=0;i<(int)hdr->dataPages;i++) {
+		const uint32_t *vpn=snapTake(&pos,end,sizeof(*vpn));
+		struct dataPage_struct *page=dataPage(cpu,*vpn,1);
+		memcpy(page->word,snapTake(&pos,end,sizeof(page->word)),sizeof(page->word));
+		memcpy(page->written,snapTake(&pos,end,sizeof(page->written)),sizeof(page->written));
+	}
+
+	const int *counts=snapTake(&pos,end,2*sizeof(int));
+	free(cpu->uninit.tbl);
+	cpu->uninit.total=counts[0];
+	cpu->uninit.n=counts[1];
+	cpu->uninit.size=hdr->uninitSlots;
+	cpu->uninit.tbl=NULL;
+	if (hdr->uninitSlots>0) {
+		size_t bytes=hdr->uninitSlots*sizeof(struct uninitRead_struct);
+		cpu->uninit.tbl=malloc(bytes);
+		memcpy(cpu->uninit.tbl,snapTake(&pos,end,bytes),bytes);
+	}
+	return 0;
+}
+
+int saveSnapshot(cpu cpu,char *fileName) {
+	// Writes a snapshot file. Returns 0 if successful
+	struct snapshot_struct snap={NULL,0,0};
+	int rc=takeSnapshot(cpu,&snap,0);
+	if (rc==0) {
+		FILE * snapF=fopen(fileName,"wb");
+		if (snapF==NULL) {
+			perror("Error - unable to open snapshot file for write");
+			rc=-1;
+		} else {
+			if (1!=fwrite(snap.data,snap.len,1,snapF)) rc=-1;
+			if (0!=fclose(snapF)) rc=-1;
+			if (rc) perror("Error - writing snapshot file");
+		}
+	}
+	free(snap.data);
+	return rc;
+}
+
+int loadSnapshot(cpu cpu,char *fileName) {
+	// Restores the cpu from a snapshot file, mapped straight into memory. Returns 0 if successful
+	int fd=open(fileName,O_RDONLY);
+	if (fd<0) {
+		perror("Error - unable to open snapshot file for read");
+		printf("...Trying to read from snapshot file %s\n",fileName);
+		return -1;
+	}
+	int rc=-1;
+	struct stat st;
+	if (0==fstat(fd,&st) && st.st_size>0) {
+		void * data=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if (data!=MAP_FAILED) {
+			rc=restoreSnapshot(cpu,data,st.st_size);
+			munmap(data,st.st_size);
+		}
+	} else printf("Restore aborted, %s is empty\n",fileName);
+	close(fd);
+	return rc;
+}
+
+/*---------------------------------------------------------
+   Internal Function definitions
+---------------------------------------------------------*/
+void * snapAppend(struct snapshot_struct *snap,const void *data,size_t len) {
+	// Adds len bytes (copied from data unless it is NULL) to the end of the snapshot
+	//    Returns where they are in the snapshot, or NULL if out of memory
+	if (snap->len+len>snap->size) {
+		size_t size=snap->size?snap->size:4096;
+		while (size<snap->len+len) size*=2;
+		char *grown=realloc(snap->data,size);
+		if (grown==NULL) return NULL;
+		snap->data=grown;
+		snap->size=size;
+	}
+	void *dest=snap->data+snap->len;
+	if (data && len) memcpy(dest,data,len);
+	snap->len+=len;
+	return dest;
+}
+
+const void * snapTake(const char **pos,const char *end,size_t len) {
+	// Returns the next len bytes of a snapshot, or NULL if there are not that many
+	if (end-*pos<(ptrdiff_t)len) return NULL;
+	const void *p=*pos;
+	*pos+=len;
+	return p;
+}
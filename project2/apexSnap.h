@@ -0,0 +1,45 @@
+#ifndef APEXSNAP_H // Guard against recursive includes
+#define APEXSNAP_H
+#include <stddef.h>
+#include <stdint.h>
+#include "apexCPU.h"
+
+/*---------------------------------------------------------
+  CPU snapshots - the complete simulation state: stage
+  		latches, forwarding buses, pipearr, registers,
+  		condition codes, code and data memory, counters
+  		and uninitialized read statistics.
+
+  		Settings that are not simulation state (trace, the
+  		opcode table, breakpoints and watchpoints) are kept
+  		from the cpu being restored into.
+---------------------------------------------------------*/
+#define APEXSNAP_MAGIC 0x53585041 // "APXS" when stored little endian
+#define APEXSNAP_VERSION 5
+
+struct snapHeader_struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t coreBytes; // bytes of apexCPU_struct saved directly
+	uint32_t numInstructions;
+	uint32_t dataPages;
+	uint32_t uninitSlots;
+	uint32_t flags;
+	unsigned char stageLatch[18]; // latch index in each stage
+	unsigned char hasPd[18]; // 1 if the latch has a predecoded instruction
+};
+
+#define SNAP_NOMEMORY 1 // code and data memory are not in the snapshot, and are left alone by restore
+
+struct snapshot_struct {
+	char *data; // malloc'd, grown as needed
+	size_t len;
+	size_t size;
+};
+
+int takeSnapshot(cpu cpu,struct snapshot_struct *snap,int flags);
+int restoreSnapshot(cpu cpu,const void *data,size_t len);
+int saveSnapshot(cpu cpu,char *fileName);
+int loadSnapshot(cpu cpu,char *fileName);
+
+#endif
@@ -0,0 +1,17 @@
+; Sums an array in the data section, using labels instead of offsets
+.equ COUNT,5
+	.data
+array:	.word 3,-4,10,20,1
+total:	.space 1
+	.text
+	MOVC R1,#array ; Address of the next element
+	MOVC R2,#COUNT ; Elements left
+	MOVC R3,#0 ; Sum so far
+loop:	LOAD R4,R1,#0
+	ADD R3,R3,R4
+	ADDL R1,R1,#4
+	SUBL R2,R2,#1 ; Sets the condition code for BNZ
+	BNZ loop
+	MOVC R5,#total
+	STORE R3,R5,#0
+	HALT